@@ -175,6 +175,13 @@ public:
      */
     std::string iXMLChunk;
     
+    //=============================================================
+    /** Sustain loop from a WAV smpl chunk or AIFF INST/MARK chunks, in samples.
+     * The loop end is the first sample after the loop. Both are -1 if the file has no loop.
+     */
+    int loopStart = -1;
+    int loopEnd = -1;
+    
 private:
     
     //=============================================================
@@ -661,6 +668,25 @@ bool AudioFile<T>::decodeWaveFile (std::vector<uint8_t>& fileData)
         iXMLChunk = std::string ((const char*) &fileData[indexOfXMLChunk + 8], chunkSize);
     }
 
+    // -----------------------------------------------------------
+    // SMPL CHUNK - we use the first loop. smpl loop ends are inclusive
+    loopStart = loopEnd = -1;
+    int indexOfSamplerChunk = getIndexOfChunk (fileData, "smpl", 12);
+    
+    if (indexOfSamplerChunk != -1 && indexOfSamplerChunk + 68 <= (int)fileData.size())
+    {
+        int sm = indexOfSamplerChunk + 8;
+        int32_t numLoops = fourBytesToInt (fileData, sm + 28);
+        int32_t start = fourBytesToInt (fileData, sm + 36 + 8);
+        int32_t end = fourBytesToInt (fileData, sm + 36 + 12) + 1;
+        
+        if (numLoops > 0 && start >= 0 && end > start && end <= numSamples)
+        {
+            loopStart = start;
+            loopEnd = end;
+        }
+    }
+
     return true;
 }
 
@@ -806,6 +832,42 @@ bool AudioFile<T>::decodeAiffFile (std::vector<uint8_t>& fileData)
         iXMLChunk = std::string ((const char*) &fileData[indexOfXMLChunk + 8], chunkSize);
     }
     
+    // -----------------------------------------------------------
+    // INST and MARK CHUNKS - the INST sustain loop refers to two markers by ID
+    loopStart = loopEnd = -1;
+    int indexOfInstChunk = getIndexOfChunk (fileData, "INST", 12, Endianness::BigEndian);
+    int indexOfMarkChunk = getIndexOfChunk (fileData, "MARK", 12, Endianness::BigEndian);
+    
+    if (indexOfInstChunk != -1 && indexOfMarkChunk != -1 && indexOfInstChunk + 22 <= (int)fileData.size())
+    {
+        int16_t playMode = twoBytesToInt (fileData, indexOfInstChunk + 16, Endianness::BigEndian);
+        int16_t beginMarker = twoBytesToInt (fileData, indexOfInstChunk + 18, Endianness::BigEndian);
+        int16_t endMarker = twoBytesToInt (fileData, indexOfInstChunk + 20, Endianness::BigEndian);
+        int32_t start = -1, end = -1;
+        
+        int m = indexOfMarkChunk + 8;
+        int16_t numMarkers = twoBytesToInt (fileData, m, Endianness::BigEndian);
+        m += 2;
+        
+        for (int i = 0; i < numMarkers && m + 7 <= (int)fileData.size(); i++)
+        {
+            int16_t id = twoBytesToInt (fileData, m, Endianness::BigEndian);
+            int32_t position = fourBytesToInt (fileData, m + 2, Endianness::BigEndian);
+            int nameLength = fileData[m + 6];
+            
+            if (id == beginMarker) start = position;
+            if (id == endMarker) end = position;
+            
+            m += 6 + ((nameLength + 2) & ~1); // pascal string padded to an even length
+        }
+        
+        if (playMode != 0 && start >= 0 && end > start && end <= numSamplesPerChannel)
+        {
+            loopStart = start;
+            loopEnd = end;
+        }
+    }
+    
     return true;
 }
 
@@ -0,0 +1,190 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// native ALSA output - the -a option uses this instead of PortAudio
+// PortAudio's callback adapter sits between us and the driver with a latency we don't get to pick
+// this opens the device in mmap mode with the period size and count from the latency step and runs its own SCHED_FIFO thread
+// when the step changes the thread lets the buffer play out and sets the device up again
+// the thread waits for a period of space, asks ALSA where it is in the DMA buffer and renders straight into it
+// the renderer writes the output format itself so every format goes straight in - with -f auto we take float if the
+// device has it, then 32 bit (dithered to 24 bits, the codec's real resolution as often as not), then 16 bit
+// the buffer is period size x count frames, so that's the latency - the status menu shows it along with the
+// jitter of the render thread's wakeups so it can be compared with PortAudio
+
+#define ALSA_PRIORITY 70  // above the effects thread - this is the audio thread
+
+snd_pcm_t *alsapcm;
+snd_pcm_format_t alsaformat;
+snd_pcm_uframes_t alsaperiod;     // frames per period we got
+unsigned int alsaperiods;         // periods in the buffer
+int alsastep=-1;                  // latency step the device is set up for
+
+const char *alsaname;
+
+// set the device up for a latency step - returns 0 if it can't
+bool alsa_setup(int step) {
+	const char *name=alsaname;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t buffersize;
+	int err,dir=0;
+	snd_pcm_format_t formats[]={SND_PCM_FORMAT_FLOAT_LE,SND_PCM_FORMAT_S32_LE,SND_PCM_FORMAT_S16_LE};  // best first
+	int formatof[]={OUTFLOAT,OUTS24,OUTS16};  // what we render for each
+
+	alsaperiod=latencysteps[step].period;
+	alsaperiods=latencysteps[step].periods;
+	alsastep=step;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(alsapcm,hw);
+	if ((err=snd_pcm_hw_params_set_access(alsapcm,hw,SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+		printf("%s can't do mmap: %s\n",name,snd_strerror(err));
+		return 0;
+	}
+	int f;
+	if (outformat != OUTAUTO) {  // asked for, or what we got last time
+		f=(outformat == OUTFLOAT) ? 0 : (outformat == OUTS16) ? 2 : 1;
+		if (snd_pcm_hw_params_test_format(alsapcm,hw,formats[f]) < 0) {
+			printf("%s doesn't take %s samples\n",name,textformats[outformat]);
+			return 0;
+		}
+	}
+	else {
+		for (f=0;f<3;++f) if (snd_pcm_hw_params_test_format(alsapcm,hw,formats[f]) == 0) break;
+		if (f == 3) {
+			printf("%s doesn't take float, 32 or 16 bit samples\n",name);
+			return 0;
+		}
+		outformat=formatof[f];
+	}
+	alsaformat=formats[f];
+	outbytes=(outformat == OUTS16) ? 2 : 4;
+	snd_pcm_hw_params_set_format(alsapcm,hw,alsaformat);
+	if ((err=snd_pcm_hw_params_set_channels(alsapcm,hw,outchannels)) < 0) {
+		printf("%s can't do %d channels: %s\n",name,outchannels,snd_strerror(err));
+		return 0;
+	}
+	snd_pcm_hw_params_set_rate_resample(alsapcm,hw,0);  // the hardware rate or nothing
+	if ((err=snd_pcm_hw_params_set_rate(alsapcm,hw,SAMPLE_RATE,0)) < 0) {
+		printf("%s can't do %d Hz: %s\n",name,SAMPLE_RATE,snd_strerror(err));
+		return 0;
+	}
+	snd_pcm_hw_params_set_period_size_near(alsapcm,hw,&alsaperiod,&dir);
+	snd_pcm_hw_params_set_periods_near(alsapcm,hw,&alsaperiods,&dir);
+	if ((err=snd_pcm_hw_params(alsapcm,hw)) < 0) {
+		printf("%s hardware setup failed: %s\n",name,snd_strerror(err));
+		return 0;
+	}
+	snd_pcm_hw_params_get_period_size(hw,&alsaperiod,&dir);  // what we actually got
+	snd_pcm_hw_params_get_buffer_size(hw,&buffersize);
+
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(alsapcm,sw);
+	snd_pcm_sw_params_set_start_threshold(alsapcm,sw,buffersize);  // starts itself when the buffer is full
+	snd_pcm_sw_params_set_avail_min(alsapcm,sw,alsaperiod);        // wake us for each period
+	if ((err=snd_pcm_sw_params(alsapcm,sw)) < 0) {
+		printf("%s software setup failed: %s\n",name,snd_strerror(err));
+		return 0;
+	}
+	outlatencyus=(float)buffersize*1000000/SAMPLE_RATE;
+	printf("ALSA %s %s (%s), %d channels, %lu frame periods, %lu frame buffer\n",name,snd_pcm_format_name(alsaformat),textformats[outformat],outchannels,alsaperiod,buffersize);
+	return 1;
+}
+
+// open the device and set it up for the current latency step
+bool alsa_open(const char *name) {
+	int err;
+	alsaname=name;
+	if ((err=snd_pcm_open(&alsapcm,name,SND_PCM_STREAM_PLAYBACK,0)) < 0) {
+		printf("Can't open ALSA device %s: %s\n",name,snd_strerror(err));
+		return 0;
+	}
+	if (!alsa_setup(latencystep)) {  // nothing to hand on to the thread
+		snd_pcm_close(alsapcm);
+		alsapcm=NULL;
+		return 0;
+	}
+	return 1;
+}
+
+// ALSA audio thread - fills the buffer a period at a time as it drains
+void *alsathread(void *threadid) {
+	struct sched_param param;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset,frames;
+	snd_pcm_sframes_t avail,done;
+	int err;
+
+	param.sched_priority=ALSA_PRIORITY;
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);  // fails quietly if we are not root
+
+	while (1) {
+		if (latencystep != alsastep) {  // play out what we have and change the buffer
+			int old=alsastep;
+			snd_pcm_drain(alsapcm);
+			if (!alsa_setup(latencystep)) {  // that one doesn't work here - stay put
+				latencyrefused=latencystep;
+				alsa_setup(old);
+				latencystep=old;
+			}
+		}
+		avail=snd_pcm_avail_update(alsapcm);
+		if (avail < 0) {  // underrun - start over with a full buffer
+			++xruns;
+			if ((err=snd_pcm_recover(alsapcm,avail,1)) < 0) printf("ALSA can't recover: %s\n",snd_strerror(err));
+			continue;
+		}
+		if ((snd_pcm_uframes_t)avail < alsaperiod) {
+			if ((err=snd_pcm_wait(alsapcm,1000)) < 0) {  // -EPIPE for an underrun, -ESTRPIPE if the device was suspended
+				++xruns;
+				if ((err=snd_pcm_recover(alsapcm,err,1)) < 0) printf("ALSA can't recover: %s\n",snd_strerror(err));
+			}
+			continue;
+		}
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		audio_timing(alsaperiod);
+		snd_pcm_uframes_t left=alsaperiod;
+		while (left > 0) {  // the period can wrap round the end of the buffer
+			frames=left;
+			if ((err=snd_pcm_mmap_begin(alsapcm,&areas,&offset,&frames)) < 0) {
+				snd_pcm_recover(alsapcm,err,1);
+				break;
+			}
+			audio_render((char *)areas[0].addr+(areas[0].first/8)+offset*outchannels*outbytes,frames);  // straight into the DMA buffer
+			done=snd_pcm_mmap_commit(alsapcm,offset,frames);
+			if ((done < 0) || ((snd_pcm_uframes_t)done != frames)) {
+				++xruns;
+				snd_pcm_recover(alsapcm,(done < 0) ? done : -EPIPE,1);
+				break;
+			}
+			left-=frames;
+		}
+		latency_load_measure(&t0,alsaperiod);
+	}
+	return 0;  // will never get here
+}
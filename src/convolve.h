@@ -0,0 +1,357 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// convolution reverb - the reverb send through an impulse response loaded from the sample library
+// uniformly partitioned FFT convolution in two stages so it's low latency without costing the audio thread much
+// the head of the IR is done in the audio thread in small partitions of CONV_HEAD samples - 1.5ms of latency, same as the other effects
+// the rest of the IR is done in big partitions of CONV_TAIL samples by the convolution thread on its own core
+// the head covers the first 2*CONV_TAIL samples of the IR so each tail partition has a whole partition of time to be done in
+// both stages are overlap-save with a delay line of input spectra, so each partition costs one FFT, one inverse FFT and a multiply-add per IR partition
+// the input is mono and the IR is stereo - left IR in the real part, right IR in the imaginary part - so one complex convolution gives both outputs
+// the IR is loaded, resampled, normalized and turned into partition spectra by the kit loader thread
+// there are two banks of spectra so a new IR can be built while the old one is playing, the threads switch over between blocks
+
+#define CONV_HEAD 64             // head partition in samples - audio thread
+#define CONV_TAIL 1024           // tail partition in samples - convolution thread
+#define CONV_HEADPARTS (2*CONV_TAIL/CONV_HEAD)
+#define CONV_MAXSECONDS 6        // longer IRs are cut off
+#define CONV_MAXLEN (CONV_MAXSECONDS*SAMPLE_RATE)
+#define CONV_TAILPARTS ((CONV_MAXLEN-CONV_TAIL-1)/CONV_TAIL)  // enough to cover CONV_MAXLEN after the head
+#define CONV_RING (4*CONV_TAIL)  // input and tail output rings - power of 2
+
+enum reverbtypes {REVERBFDN,REVERBIR};  // enum index must match the text in the menus
+int16_t fxreverbtype=REVERBFDN;
+char irfilename[PATHLEN]="";  // IR file relative to filesroot, "" if none
+
+struct cpx {
+	float re,im;
+};
+
+struct fftplan {
+	int n;
+	cpx *twiddle;   // e^(-2pi*i*k/n) for k < n/2
+	uint16_t *rev;  // bit reversed order
+} convheadfft,convtailfft;
+
+// IR partition spectra - already scaled for the unscaled inverse FFT
+struct irbank {
+	int tailparts;  // tail partitions in this IR
+	cpx head[CONV_HEADPARTS][2*CONV_HEAD];
+	cpx tail[CONV_TAILPARTS][2*CONV_TAIL];
+} irbanks[2];
+
+std::atomic<int8_t> convbank(-1);      // bank with the current IR, -1 if none loaded
+std::atomic<int8_t> convheadbank(-1);  // bank the audio thread is using
+std::atomic<int8_t> convtailbank(-1);  // bank the convolution thread is using
+std::atomic<bool> convtailbusy(0);     // convolution thread is working on a partition
+
+// audio thread state
+float convheadin[2*CONV_HEAD];             // previous and current head partition of input
+cpx convheadfdl[CONV_HEADPARTS][2*CONV_HEAD];  // input spectra, newest at convheadnext-1
+int convheadnext;
+cpx convheadout[CONV_HEAD];                // head output being played
+int convheadpos;
+bool convon;
+
+// shared by the audio and convolution threads - all indexed by convtime
+float convtailin[CONV_RING];               // input
+cpx convtailout[CONV_RING];                // tail output - the audio thread zeroes it as it plays it
+std::atomic<uint32_t> convtime;            // samples since the reverb started
+std::atomic<uint32_t> convblocks;          // tail partitions of input ready
+std::atomic<uint32_t> convepoch;           // changes every time the reverb starts so the convolution thread starts clean
+sem_t convsem;
+
+// convolution thread state
+cpx convtailfdl[CONV_TAILPARTS][2*CONV_TAIL];
+cpx convacc[2*CONV_TAIL];
+
+float convloadus;              // smoothed processing time per tail partition
+float convblockus=1;           // length of a tail partition
+std::atomic<int16_t> convlate(0);
+
+void fft_init(fftplan *p, int n) {
+	int bits=0;
+	while ((1<<bits) < n) ++bits;
+	p->n=n;
+	p->twiddle=(cpx *)malloc(n/2*sizeof(cpx));
+	p->rev=(uint16_t *)malloc(n*sizeof(uint16_t));
+	for (int k=0;k<n/2;++k) {
+		p->twiddle[k].re=cos(2*M_PI*k/n);
+		p->twiddle[k].im=-sin(2*M_PI*k/n);
+	}
+	for (int i=0;i<n;++i) {
+		int r=0;
+		for (int b=0;b<bits;++b) if (i & (1<<b)) r|=1<<(bits-1-b);
+		p->rev[i]=r;
+	}
+}
+
+// in place radix 2 FFT - the inverse isn't scaled
+void fft(const fftplan *p, cpx *x, bool inverse) {
+	int n=p->n;
+	for (int i=0;i<n;++i) {
+		int r=p->rev[i];
+		if (r > i) std::swap(x[i],x[r]);
+	}
+	float sign=inverse ? -1.0f : 1.0f;
+	for (int len=2;len<=n;len<<=1) {
+		int half=len>>1;
+		int step=n/len;
+		for (int i=0;i<n;i+=len) {
+			for (int j=0;j<half;++j) {
+				float wr=p->twiddle[j*step].re;
+				float wi=p->twiddle[j*step].im*sign;
+				cpx *a=&x[i+j];
+				cpx *b=&x[i+j+half];
+				float tr=b->re*wr-b->im*wi;
+				float ti=b->re*wi+b->im*wr;
+				b->re=a->re-tr;
+				b->im=a->im-ti;
+				a->re+=tr;
+				a->im+=ti;
+			}
+		}
+	}
+}
+
+// acc+=x*h bin by bin
+void conv_mac(cpx *acc, const cpx *x, const cpx *h, int n) {
+	for (int k=0;k<n;++k) {
+		acc[k].re+=x[k].re*h[k].re-x[k].im*h[k].im;
+		acc[k].im+=x[k].re*h[k].im+x[k].im*h[k].re;
+	}
+}
+
+// one partition of the convolution - overlap-save with a delay line of input spectra
+// in is the previous and current partition of input, the result is the output for the current partition
+void conv_partition(const fftplan *p, const float *in, cpx *fdl, int next, int slots, const cpx *ir, int parts, cpx *acc) {
+	int n=p->n;
+	cpx *x=&fdl[next*n];
+	for (int i=0;i<n;++i) {
+		x[i].re=in[i];
+		x[i].im=0;
+	}
+	fft(p,x,0);
+	memset(acc,0,n*sizeof(cpx));
+	for (int k=0;k<parts;++k) {  // newest input with the start of the IR, oldest with the end
+		conv_mac(acc,&fdl[next*n],&ir[k*n],n);
+		if (--next < 0) next=slots-1;
+	}
+	fft(p,acc,1);
+}
+
+void conv_init(void) {
+	sem_init(&convsem,0,0);
+	fft_init(&convheadfft,2*CONV_HEAD);
+	fft_init(&convtailfft,2*CONV_TAIL);
+}
+
+// start from silence - audio thread
+void conv_reset(void) {
+	memset(convheadin,0,sizeof(convheadin));
+	memset(convheadfdl,0,sizeof(convheadfdl));
+	memset(convheadout,0,sizeof(convheadout));
+	memset(convtailin,0,sizeof(convtailin));
+	memset(convtailout,0,sizeof(convtailout));
+	convheadnext=0;
+	convheadpos=0;
+	convtime=0;
+	convblocks=0;
+	++convepoch;
+}
+
+// run the IR reverb on this block's reverb send and mix it in - renderer only
+// when it's on it takes the reverb sends so the FDN reverb gets nothing
+void conv_block(float *out, fxsendframe *send, unsigned long frames) {
+	int8_t bank=convbank.load();
+	convheadbank=bank;  // tells the loader we're done with the other bank
+	if ((fxreverbtype != REVERBIR) || (bank < 0)) {
+		convon=0;
+		return;
+	}
+	if (!convon) conv_reset();
+	convon=1;
+
+	const irbank *b=&irbanks[bank];
+	float level=(float)fxreverblevel/1000;
+	uint32_t t=convtime.load(std::memory_order_relaxed);
+	for (unsigned long i=0;i<frames;++i) {
+		float x=(send[i].reverbL+send[i].reverbR)*0.5f;
+		send[i].reverbL=0;
+		send[i].reverbR=0;
+		convheadin[CONV_HEAD+convheadpos]=x;
+		convtailin[t & (CONV_RING-1)]=x;
+		cpx *tail=&convtailout[(t-CONV_HEAD) & (CONV_RING-1)];  // the head is a partition late so the tail is too
+		out[i*outchannels]+=(convheadout[convheadpos].im+tail->im)*level;  // the first pair - channel 0 is the right
+		out[i*outchannels+1]+=(convheadout[convheadpos].re+tail->re)*level;
+		tail->re=0;
+		tail->im=0;
+		++t;
+		if (++convheadpos == CONV_HEAD) {  // got a head partition
+			cpx acc[2*CONV_HEAD];
+			conv_partition(&convheadfft,convheadin,&convheadfdl[0][0],convheadnext,CONV_HEADPARTS,&b->head[0][0],CONV_HEADPARTS,acc);
+			memcpy(convheadout,&acc[CONV_HEAD],sizeof(convheadout));
+			memcpy(convheadin,&convheadin[CONV_HEAD],CONV_HEAD*sizeof(float));  // current partition becomes the previous one
+			convheadnext=(convheadnext+1)%CONV_HEADPARTS;
+			convheadpos=0;
+		}
+		if ((t & (CONV_TAIL-1)) == 0) {  // got a tail partition
+			convtime.store(t,std::memory_order_relaxed);
+			convblocks.store(t/CONV_TAIL,std::memory_order_release);
+			sem_post(&convsem);
+		}
+	}
+	convtime.store(t,std::memory_order_release);
+}
+
+// convolution thread - does the tail partitions as the audio thread finishes them
+// tail partition j is input samples j*CONV_TAIL on and its output starts 2 partitions later, after the head
+void *convthread(void *threadid) {
+	struct sched_param param;
+	struct timespec t0,t1;
+	cpu_set_t cpus;
+	uint32_t next=0;
+	uint32_t epoch=convepoch;
+	int fdlnext=0;
+
+	int cpu=sysconf(_SC_NPROCESSORS_ONLN)-2;  // the effects thread has the last core
+	if (cpu < 0) cpu=0;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu,&cpus);
+	pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+	param.sched_priority=55;  // below the effects thread - it has a whole partition of time
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);  // fails quietly if we are not root
+
+	while (1) {
+		sem_wait(&convsem);
+		convtailbusy=1;
+		int8_t bank=convbank;
+		convtailbank=bank;
+		if (convepoch != epoch) {  // reverb was restarted
+			epoch=convepoch;
+			next=0;
+			fdlnext=0;
+			memset(convtailfdl,0,sizeof(convtailfdl));
+		}
+		uint32_t ready=convblocks.load(std::memory_order_acquire);
+		if (ready-next > 2) {  // so far behind the input has been overwritten - skip to the newest
+			convlate+=ready-next-1;
+			next=ready-1;
+		}
+		while ((bank >= 0) && (next != ready)) {
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			float in[2*CONV_TAIL];
+			uint32_t start=(next-1)*CONV_TAIL;  // previous and current partition - the first time that's silence
+			for (int i=0;i<2*CONV_TAIL;++i) in[i]=convtailin[(start+i) & (CONV_RING-1)];
+			conv_partition(&convtailfft,in,&convtailfdl[0][0],fdlnext,CONV_TAILPARTS,&irbanks[bank].tail[0][0],irbanks[bank].tailparts,convacc);
+			uint32_t at=(next+2)*CONV_TAIL;
+			uint32_t played=convtime.load(std::memory_order_acquire)-CONV_HEAD;
+			if ((epoch == convepoch) && ((int32_t)(at-played) >= 0)) {
+				for (int i=0;i<CONV_TAIL;++i) convtailout[(at+i) & (CONV_RING-1)]=convacc[CONV_TAIL+i];
+			}
+			else ++convlate;  // too late to play it
+			++next;
+			fdlnext=(fdlnext+1)%CONV_TAILPARTS;
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			float us=(t1.tv_sec-t0.tv_sec)*1e6f+(t1.tv_nsec-t0.tv_nsec)/1000.0f;
+			convloadus+=(us-convloadus)*0.05f;
+			convblockus=(float)CONV_TAIL*1000000/SAMPLE_RATE;
+		}
+		convtailbusy=0;
+	}
+	return 0;  // will never get here
+}
+
+// load irfilename into the bank that isn't playing and switch to it - kit loader thread
+// resamples to the engine rate, mono IRs go to both sides
+// normalized to unit energy so the Reverb Level works the same with any IR
+bool conv_load(void) {
+	char temp[PATHLEN];
+	AudioFile<double> ir;
+
+	if (irfilename[0] == 0) return 0;
+	snprintf(temp,PATHLEN,"%s/%s",filesroot,irfilename);
+	if (!ir.load(temp) || (ir.getNumSamplesPerChannel() < 2)) {
+		printf("Can't load IR %s\n",temp);
+		return 0;
+	}
+	int chans=ir.getNumChannels();
+	int srclen=ir.getNumSamplesPerChannel();
+	double step=(double)ir.getSampleRate()/SAMPLE_RATE;
+	int len=(int)((srclen-1)/step);
+	if (len > CONV_MAXLEN) len=CONV_MAXLEN;
+	std::vector<cpx> h(len);
+	double energy=0;
+	for (int i=0;i<len;++i) {
+		double p=i*step;
+		int i0=(int)p;
+		double f=p-i0;
+		double l=ir.samples[0][i0]+(ir.samples[0][i0+1]-ir.samples[0][i0])*f;
+		double r=ir.samples[chans-1][i0]+(ir.samples[chans-1][i0+1]-ir.samples[chans-1][i0])*f;
+		h[i].re=l;
+		h[i].im=r;
+		energy+=l*l+r*r;
+	}
+	if (energy <= 0) {
+		printf("IR %s is silent\n",temp);
+		return 0;
+	}
+	float gain=1.0/sqrt(energy/2);
+
+	int8_t cur=convbank;
+	int8_t b=(cur == 0) ? 1 : 0;
+	while ((convheadbank == b) || (convtailbusy && (convtailbank == b))) usleep(1000);  // wait till nobody is using it
+	irbank *bank=&irbanks[b];
+	for (int k=0;k<CONV_HEADPARTS;++k) {
+		cpx *H=bank->head[k];
+		memset(H,0,sizeof(bank->head[k]));
+		for (int i=0;i<CONV_HEAD;++i) {
+			int n=k*CONV_HEAD+i;
+			if (n >= len) break;
+			H[i].re=h[n].re*gain/(2*CONV_HEAD);  // inverse FFT scaling goes in here
+			H[i].im=h[n].im*gain/(2*CONV_HEAD);
+		}
+		fft(&convheadfft,H,0);
+	}
+	bank->tailparts=0;
+	if (len > 2*CONV_TAIL) bank->tailparts=(len-CONV_TAIL-1)/CONV_TAIL;
+	for (int k=0;k<bank->tailparts;++k) {
+		cpx *H=bank->tail[k];
+		memset(H,0,sizeof(bank->tail[k]));
+		for (int i=0;i<CONV_TAIL;++i) {
+			int n=(k+2)*CONV_TAIL+i;
+			if (n >= len) break;
+			H[i].re=h[n].re*gain/(2*CONV_TAIL);
+			H[i].im=h[n].im*gain/(2*CONV_TAIL);
+		}
+		fft(&convtailfft,H,0);
+	}
+	convbank=b;
+	printf("IR %s loaded, %d ms\n",irfilename,len*1000/SAMPLE_RATE);
+	return 1;
+}
@@ -0,0 +1,146 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+// audio rate CV inputs for through zero FM and tape scrub effects
+// up to FASTCV_CHANNELS CV inputs can be sampled at FASTCV_RATE by a high priority thread
+// each one goes into its own ring buffer - one writer (the sampling thread) and one reader (the audio callback) so no locks needed
+// the audio callback upsamples each ring to the engine rate once per block and the renderer applies it per sample
+// a slot picks its channel with the "Fast CV" menu item - the sampling thread follows whatever the slots ask for
+
+#define FASTCV_RATE 4000     // sample rate of the fast CV channels in Hz
+#define FASTCV_CHANNELS 2    // max number of CV channels sampled at the fast rate
+#define FASTCV_RINGSIZE 256  // must be a power of 2
+#define FASTCV_LATENCY 4     // number of samples we try to keep buffered to ride out thread jitter
+#define FM_MAXINDEX 4.0      // FM depth of 1.00 swings the playback rate +-4x ie well through zero
+
+struct fastcvring {
+	std::atomic<int8_t> channel;   // CV channel 1-8 being sampled, 0=not in use
+	std::atomic<uint32_t> head;    // count of samples written - only the sampling thread changes this
+	float buf[FASTCV_RINGSIZE];    // normalized 0-1.0 CV samples
+	uint32_t readpos;              // integer part of the read position - audio thread only
+	float frac;                    // fractional part of the read position
+	float out[MAXFRAMES];          // CV upsampled to the engine rate for the current block
+} fastcv[FASTCV_CHANNELS];
+
+// work out which CV channels the slots want at audio rate
+// first come first served - if more than FASTCV_CHANNELS are asked for the extra slots just don't get modulated
+int fastcv_assign(void) {
+	int8_t want[FASTCV_CHANNELS]={0};
+	int i,k,n=0;
+	for (i=0;i<NUMSAMPLES;++i) {
+		int8_t ch=samp[i].fastCV;
+		if (ch==0) continue;
+		for (k=0;k<n;++k) if (want[k]==ch) break;
+		if ((k==n) && (n < FASTCV_CHANNELS)) want[n++]=ch;
+	}
+	for (k=0;k<FASTCV_CHANNELS;++k) if (fastcv[k].channel != want[k]) fastcv[k].channel=want[k];
+	return n;
+}
+
+// fast CV sampling thread
+// runs on an absolute timer so the sample rate stays put even if a read gets held off by an OLED transfer
+
+void *fastcvthread(void *threadid) {
+	struct timespec next;
+	struct sched_param param;
+	int k,n;
+
+	param.sched_priority=50;  // below the audio thread but above the UI
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);  // fails quietly if we are not root
+
+	clock_gettime(CLOCK_MONOTONIC,&next);
+	while (1) {
+		n=fastcv_assign();
+		if (n==0) {  // nobody wants audio rate CV - idle
+			usleep(10000);
+			clock_gettime(CLOCK_MONOTONIC,&next);
+			continue;
+		}
+		pthread_mutex_lock(&spilock);
+		for (k=0;k<n;++k) {
+			uint16_t raw;
+			int ch=LTC1857convert(fastcv[k].channel-1,&raw)+1; // result is for the previous conversion
+			for (int r=0;r<n;++r) {  // put it in the ring that wants that channel, if any
+				if (fastcv[r].channel == ch) {
+					uint32_t head=fastcv[r].head.load(std::memory_order_relaxed);
+					fastcv[r].buf[head & (FASTCV_RINGSIZE-1)]=(float)raw/4096.0;
+					fastcv[r].head.store(head+1,std::memory_order_release);
+				}
+			}
+		}
+		pthread_mutex_unlock(&spilock);
+
+		next.tv_nsec+=1000000000/FASTCV_RATE;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec-=1000000000;
+			++next.tv_sec;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL);
+	}
+	return 0;  // will never get here
+}
+
+// upsample the fast CV rings to the engine rate - call once per block from the audio callback
+// linear interpolation at a fixed step with a little rate correction to track the sampling thread's clock
+
+void fastcv_upsample(unsigned long frames) {
+	const float step=(float)FASTCV_RATE/SAMPLE_RATE;
+	unsigned long i;
+	int k;
+
+	for (k=0;k<FASTCV_CHANNELS;++k) {
+		fastcvring *r=&fastcv[k];
+		if (r->channel == 0) continue;
+		uint32_t head=r->head.load(std::memory_order_acquire);
+		uint32_t lag=head-r->readpos;  // unsigned math handles wraparound
+		if ((lag > FASTCV_RINGSIZE/2) || (lag < 2)) {  // way off - channel just changed or the sampling thread stalled
+			r->readpos=head-FASTCV_LATENCY;
+			r->frac=0;
+		}
+		float inc=step;
+		if (lag > 2*FASTCV_LATENCY) inc*=1.01;   // nudge the read rate to hold the latency where we want it
+		if (lag < FASTCV_LATENCY/2) inc*=0.99;
+		for (i=0;i<frames;++i) {
+			float a=r->buf[r->readpos & (FASTCV_RINGSIZE-1)];
+			float b=r->buf[(r->readpos+1) & (FASTCV_RINGSIZE-1)];
+			r->out[i]=a+(b-a)*r->frac;
+			r->frac+=inc;
+			if (r->frac >= 1.0) {
+				r->frac-=1.0;
+				if ((r->readpos+2) != head) ++r->readpos; // hold the newest sample if we run dry
+			}
+		}
+	}
+}
+
+// find the upsampled block for a CV channel 1-8
+// returns NULL if that channel is not being sampled at audio rate
+float *fastcv_lookup(int16_t channel) {
+	if (channel == 0) return NULL;
+	for (int k=0;k<FASTCV_CHANNELS;++k) if (fastcv[k].channel == channel) return fastcv[k].out;
+	return NULL;
+}
@@ -0,0 +1,245 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+// file browser backend for big sample libraries
+// the old code read the whole directory into a fixed array and sorted it every time - more than 400 files and it crashed
+// this only ever keeps one screen page of entries in memory
+// a page is found by streaming the directory and keeping the N entries that sort next after a known entry
+// so paging up or down is one pass over the directory and opening a directory only needs a count
+// to jump to an arbitrary page (eg coming back to the last file we loaded) we keep the first entry of every
+// FB_ANCHOR_STRIDE'th page as we find them, so a jump costs at most a couple of passes
+// directories can be nested as deep as FB_MAXDEPTH - ".." is always the last entry and goes up a level
+// sample lengths come from the sample index so listing a directory never opens the files
+
+#define FB_PAGELINES 5       // entries per page - the file menu shows one page
+#define FB_ANCHOR_STRIDE 8   // remember the first entry of every 8th page
+#define FB_MAXDEPTH 16       // max directory nesting
+
+enum filesorts {SORTNAME,SORTLENGTH};  // browser sort order - enum index must match the text in the menus
+int16_t filesort=SORTNAME;
+
+// holds file and directory info
+struct fileinfo {
+	char name[NAME_MAX+1];
+	bool isdir;   // true if directory
+	int32_t msec; // length in ms from the sample index, -1 if not known
+};
+
+struct filebrowser {
+	char path[PATHLEN];          // directory being browsed relative to filesroot, "" is the root
+	int count;                   // number of entries including ".."
+	int page;                    // page in window[], -1 if none
+	int winsize;                 // number of entries in window[]
+	fileinfo window[FB_PAGELINES];
+	fileinfo *anchors;           // first entry of pages 0, FB_ANCHOR_STRIDE, 2*FB_ANCHOR_STRIDE etc. - empty name if we don't know it yet
+	int numanchors;
+	int depth;                   // directory nesting depth
+	int16_t parentindex[FB_MAXDEPTH];  // selected entry in each parent directory so ".." goes back to it
+} browser;
+
+fileinfo updir={"..",0,-1};  // last entry is to go up - special case, don't treat it as a directory
+fileinfo fbscratch[FB_ANCHOR_STRIDE*FB_PAGELINES+1];  // selection buffer
+
+// sort order for the browser - by length puts directories and unknown files first
+// ties go by name so the order is always total, the paging depends on that
+int fb_compare(const fileinfo *a, const fileinfo *b) {
+	if ((filesort == SORTLENGTH) && (a->msec != b->msec)) return (a->msec < b->msec) ? -1 : 1;
+	return strcmp(a->name,b->name);
+}
+
+// full path of the directory being browsed
+void fb_dirpath(char *out, int len) {
+	if (browser.path[0]) snprintf(out,len,"%s/%s",filesroot,browser.path);
+	else snprintf(out,len,"%s",filesroot);
+}
+
+// read the next usable entry from a directory - skips . .. and hidden files
+bool fb_readentry(DIR *d, fileinfo *e) {
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (dir->d_name[0] == '.') continue;
+		strcpy(e->name,dir->d_name);
+		e->isdir=(dir->d_type == DT_DIR);
+		if (dir->d_type == DT_UNKNOWN) {  // some filesystems don't fill in d_type
+			char temp[PATHLEN];
+			struct stat st;
+			fb_dirpath(temp,PATHLEN);
+			strncat(temp,"/",PATHLEN-strlen(temp)-1);
+			strncat(temp,dir->d_name,PATHLEN-strlen(temp)-1);
+			e->isdir=(stat(temp,&st)==0) && S_ISDIR(st.st_mode);
+		}
+		e->msec=-1;
+		if (!e->isdir) {
+			char temp[PATHLEN];
+			if (browser.path[0]) snprintf(temp,PATHLEN,"%s/%s",browser.path,dir->d_name);
+			else snprintf(temp,PATHLEN,"%s",dir->d_name);
+			e->msec=index_msec(temp);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// one pass over the directory keeping the n entries that sort first after lo, or last before hi if largest is set
+// lo and hi can be NULL for no limit, loinclusive lets lo itself match
+// results are sorted into out[] and the number found is returned
+
+int fb_select(const fileinfo *lo, bool loinclusive, const fileinfo *hi, fileinfo *out, int n, bool largest) {
+	char temp[PATHLEN];
+	fileinfo e;
+	int found=0;
+	int i;
+
+	fb_dirpath(temp,PATHLEN);
+	DIR *d=opendir(temp);
+	if (d == NULL) return 0;
+	while (fb_readentry(d,&e)) {
+		if (lo != NULL) {
+			int c=fb_compare(&e,lo);
+			if ((c < 0) || ((c == 0) && !loinclusive)) continue;
+		}
+		if ((hi != NULL) && (fb_compare(&e,hi) >= 0)) continue;
+		if (!largest) {  // keep the n smallest
+			if ((found == n) && (fb_compare(&e,&out[n-1]) >= 0)) continue;
+			if (found < n) ++found;
+			for (i=found-1;(i > 0) && (fb_compare(&e,&out[i-1]) < 0);--i) out[i]=out[i-1];
+			out[i]=e;
+		}
+		else {  // keep the n largest
+			if (found < n) {
+				for (i=found;(i > 0) && (fb_compare(&e,&out[i-1]) < 0);--i) out[i]=out[i-1];
+				out[i]=e;
+				++found;
+			}
+			else if (fb_compare(&e,&out[0]) > 0) {
+				for (i=0;(i < n-1) && (fb_compare(&e,&out[i+1]) > 0);++i) out[i]=out[i+1];
+				out[i]=e;
+			}
+		}
+	}
+	closedir(d);
+	return found;
+}
+
+// open a directory relative to filesroot - returns number of entries including ".."
+int fb_open(const char *relpath) {
+	char temp[PATHLEN];
+	fileinfo e;
+	int n=0;
+
+	snprintf(browser.path,PATHLEN,"%s",relpath);
+	fb_dirpath(temp,PATHLEN);
+	DIR *d=opendir(temp);
+	if (d != NULL) {
+		while (fb_readentry(d,&e)) ++n;  // just count them
+		closedir(d);
+	}
+	browser.count=n+1;  // plus ".."
+	browser.page=-1;
+	browser.winsize=0;
+	free(browser.anchors);
+	browser.numanchors=n/(FB_PAGELINES*FB_ANCHOR_STRIDE)+1;
+	browser.anchors=(fileinfo *)calloc(browser.numanchors,sizeof(fileinfo));
+	return browser.count;
+}
+
+// find the first entry of anchor page k, working forward from the nearest one we know
+void fb_findanchor(int k) {
+	int j=k;
+	while ((j > 0) && (browser.anchors[j].name[0] == 0)) --j;
+	if (browser.anchors[j].name[0] == 0) {  // don't even know the first entry yet
+		if (fb_select(NULL,0,NULL,fbscratch,1,0) == 0) return;
+		browser.anchors[0]=fbscratch[0];
+	}
+	for (;j < k;++j) {  // first entry of the next anchor page is FB_ANCHOR_STRIDE pages on
+		int n=fb_select(&browser.anchors[j],1,NULL,fbscratch,FB_ANCHOR_STRIDE*FB_PAGELINES+1,0);
+		if (n < FB_ANCHOR_STRIDE*FB_PAGELINES+1) return;  // ran out of entries
+		browser.anchors[j+1]=fbscratch[n-1];
+	}
+}
+
+// get page p of the sorted directory into window[]
+void fb_loadpage(int p) {
+	int n;
+	if ((p == browser.page+1) && (browser.winsize == FB_PAGELINES)) {  // next page - entries after the last one we have
+		fileinfo last=browser.window[FB_PAGELINES-1];
+		browser.winsize=fb_select(&last,0,NULL,browser.window,FB_PAGELINES,0);
+	}
+	else if ((p == browser.page-1) && (browser.winsize > 0)) {  // previous page - entries before the first one we have
+		fileinfo first=browser.window[0];
+		browser.winsize=fb_select(NULL,0,&first,browser.window,FB_PAGELINES,1);
+	}
+	else {  // jump - start from the anchor at or before the page
+		int k=p/FB_ANCHOR_STRIDE;
+		int skip=(p%FB_ANCHOR_STRIDE)*FB_PAGELINES;  // entries between the anchor and the page we want
+		fb_findanchor(k);
+		n=fb_select(&browser.anchors[k],1,NULL,fbscratch,skip+FB_PAGELINES,0);
+		browser.winsize=0;
+		for (int i=skip;i<n;++i) browser.window[browser.winsize++]=fbscratch[i];
+	}
+	browser.page=p;
+	if (((p % FB_ANCHOR_STRIDE) == 0) && (browser.winsize > 0)) browser.anchors[p/FB_ANCHOR_STRIDE]=browser.window[0];  // remember it for jumps
+}
+
+// get an entry by its sorted position - the pointer is only good until the next call for a different page
+fileinfo *fb_entry(int index) {
+	if (index >= browser.count-1) return &updir;
+	if (index/FB_PAGELINES != browser.page) fb_loadpage(index/FB_PAGELINES);
+	if (index%FB_PAGELINES >= browser.winsize) return &updir;  // directory changed under us
+	return &browser.window[index%FB_PAGELINES];
+}
+
+// go into a subdirectory - index is the entry we came from so we can go back to it
+int fb_enter(const char *name, int16_t index) {
+	char temp[PATHLEN];
+	if (browser.depth >= FB_MAXDEPTH) return browser.count;
+	browser.parentindex[browser.depth++]=index;
+	if (browser.path[0]) snprintf(temp,PATHLEN,"%s/%s",browser.path,name);
+	else snprintf(temp,PATHLEN,"%s",name);
+	return fb_open(temp);
+}
+
+// go up a level - returns the index of the entry we came from
+int16_t fb_up(void) {
+	char temp[PATHLEN];
+	if (browser.depth == 0) {  // already at the top
+		fb_open("");
+		return 0;
+	}
+	strcpy(temp,browser.path);
+	char *slash=strrchr(temp,'/');
+	if (slash != NULL) *slash=0;
+	else temp[0]=0;
+	fb_open(temp);
+	return browser.parentindex[--browser.depth];
+}
+
+// back to the root
+void fb_root(void) {
+	browser.depth=0;
+	fb_open("");
+}
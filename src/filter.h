@@ -0,0 +1,157 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// per voice multimode filter
+// each slot has a state variable filter - the trapezoidal kind, so it stays stable when the cutoff is swept fast
+// Filter picks low pass, high pass or band pass, Cutoff goes 20Hz to 20kHz on an exponential scale and Resonance
+// goes from no peak to a Q of about 20. both can follow a CV and the MIDI map
+// coefficients are worked out once per block when each slot is rendered, then all the filters are run together
+// filter state is kept as arrays - 16 lanes, a left and right for each of the 8 slots - so with NEON four lanes
+// are filtered at once. lanes are grouped right 0-3, right 4-7, left 0-3, left 4-7 and a group with no filters on is skipped
+// the output is a mix of the input, band and low pass outputs so every mode is the same code with different weights
+
+#define FILTER_LANES (NUMSAMPLES*2)
+#define FILTER_MINHZ 20.0f       // cutoff at 0
+#define FILTER_RANGE 1000.0f     // cutoff at 1.0 is this times FILTER_MINHZ
+#define FILTER_MAXHZ (0.45f*SAMPLE_RATE)
+
+struct filterbank {
+	float ic1[FILTER_LANES];  // integrator states
+	float ic2[FILTER_LANES];
+	float a1[FILTER_LANES];   // coefficients for this block
+	float a2[FILTER_LANES];
+	float a3[FILTER_LANES];
+	float m0[FILTER_LANES];   // output mix - input, band pass, low pass
+	float m1[FILTER_LANES];
+	float m2[FILTER_LANES];
+	float *buf[FILTER_LANES]; // voice buffer each lane filters in place this block
+	bool on[FILTER_LANES];
+} __attribute__((aligned(16))) filters;
+
+float filterscratch[MAXFRAMES];  // somewhere for the lanes of slots that weren't rendered to point
+
+// lane of a slot's right or left channel
+inline int filter_lane(int s, int left) {
+	return left*NUMSAMPLES+s;
+}
+
+// work out a slot's coefficients for this block and say where its audio is - call for every slot every block
+// bufL and bufR are NULL if the slot wasn't rendered
+void filter_update(int s, float *bufL, float *bufR) {
+	int r=filter_lane(s,0);
+	int l=filter_lane(s,1);
+	filters.buf[r]=(bufR != NULL) ? bufR : filterscratch;
+	filters.buf[l]=(bufL != NULL) ? bufL : filterscratch;
+	if ((samp[s].filter == FILTEROFF) || (bufL == NULL)) {
+		for (int lane=r;lane<=l;lane+=NUMSAMPLES) {
+			filters.on[lane]=0;
+			filters.ic1[lane]=filters.ic2[lane]=0;  // starts clean when it's turned back on
+			filters.a1[lane]=filters.a2[lane]=filters.a3[lane]=0;  // pass straight through if its group runs
+			filters.m0[lane]=1;
+			filters.m1[lane]=filters.m2[lane]=0;
+		}
+		return;
+	}
+	float c=(float)samp[s].cutoff/1000+mapvalue[s][MAP_CUTOFF];
+	if (c < 0) c=0;
+	if (c > 1.0f) c=1.0f;
+	float hz=FILTER_MINHZ*powf(FILTER_RANGE,c);
+	if (hz > FILTER_MAXHZ) hz=FILTER_MAXHZ;
+	float res=(float)samp[s].resonance/1000+mapvalue[s][MAP_RESONANCE];
+	if (res < 0) res=0;
+	if (res > 1.0f) res=1.0f;
+	float k=2.0f-1.95f*res;  // damping - 1/Q
+	float g=tanf(M_PI*hz/SAMPLE_RATE);
+	float a1=1.0f/(1.0f+g*(g+k));
+	float m0=0,m1=0,m2=0;
+	switch (samp[s].filter) {
+		case FILTERLP: m2=1; break;
+		case FILTERHP: m0=1; m1=-k; m2=-1; break;
+		case FILTERBP: m1=1; break;
+	}
+	for (int lane=r;lane<=l;lane+=NUMSAMPLES) {  // same for left and right
+		filters.on[lane]=1;
+		filters.a1[lane]=a1;
+		filters.a2[lane]=g*a1;
+		filters.a3[lane]=g*g*a1;
+		filters.m0[lane]=m0;
+		filters.m1[lane]=m1;
+		filters.m2[lane]=m2;
+	}
+}
+
+// run the filters on a block - each lane filters its voice buffer in place
+void filter_process(unsigned long frames) {
+	for (int g=0;g<FILTER_LANES;g+=4) {
+		if (!(filters.on[g] || filters.on[g+1] || filters.on[g+2] || filters.on[g+3])) continue;
+		float *b0=filters.buf[g],*b1=filters.buf[g+1],*b2=filters.buf[g+2],*b3=filters.buf[g+3];
+#ifdef __ARM_NEON
+		float32x4_t ic1=vld1q_f32(&filters.ic1[g]);
+		float32x4_t ic2=vld1q_f32(&filters.ic2[g]);
+		float32x4_t a1=vld1q_f32(&filters.a1[g]);
+		float32x4_t a2=vld1q_f32(&filters.a2[g]);
+		float32x4_t a3=vld1q_f32(&filters.a3[g]);
+		float32x4_t m0=vld1q_f32(&filters.m0[g]);
+		float32x4_t m1=vld1q_f32(&filters.m1[g]);
+		float32x4_t m2=vld1q_f32(&filters.m2[g]);
+		float x[4] __attribute__((aligned(16)));
+		for (unsigned long i=0;i<frames;++i) {
+			x[0]=b0[i]; x[1]=b1[i]; x[2]=b2[i]; x[3]=b3[i];
+			float32x4_t v0=vld1q_f32(x);
+			float32x4_t v3=vsubq_f32(v0,ic2);
+			float32x4_t v1=vmlaq_f32(vmulq_f32(a1,ic1),a2,v3);
+			float32x4_t v2=vaddq_f32(ic2,vmlaq_f32(vmulq_f32(a2,ic1),a3,v3));
+			ic1=vsubq_f32(vaddq_f32(v1,v1),ic1);
+			ic2=vsubq_f32(vaddq_f32(v2,v2),ic2);
+			vst1q_f32(x,vmlaq_f32(vmlaq_f32(vmulq_f32(m0,v0),m1,v1),m2,v2));
+			b0[i]=x[0]; b1[i]=x[1]; b2[i]=x[2]; b3[i]=x[3];
+		}
+		vst1q_f32(&filters.ic1[g],ic1);
+		vst1q_f32(&filters.ic2[g],ic2);
+#else
+		float *bufs[4]={b0,b1,b2,b3};
+		for (int lane=g;lane<g+4;++lane) {  // same math a lane at a time
+			float *b=bufs[lane-g];
+			float ic1=filters.ic1[lane],ic2=filters.ic2[lane];
+			float a1=filters.a1[lane],a2=filters.a2[lane],a3=filters.a3[lane];
+			float m0=filters.m0[lane],m1=filters.m1[lane],m2=filters.m2[lane];
+			for (unsigned long i=0;i<frames;++i) {
+				float v0=b[i];
+				float v3=v0-ic2;
+				float v1=a1*ic1+a2*v3;
+				float v2=ic2+a2*ic1+a3*v3;
+				ic1=2*v1-ic1;
+				ic2=2*v2-ic2;
+				b[i]=m0*v0+m1*v1+m2*v2;
+			}
+			filters.ic1[lane]=ic1;
+			filters.ic2[lane]=ic2;
+		}
+#endif
+	}
+}
@@ -0,0 +1,223 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// send effects - a stereo delay and a reverb on the mix
+// each slot has a Delay Send and a Reverb Send, taken after its level and pan
+// the effects run on their own thread, pinned to the last core, so they don't use up the audio thread's time
+// the renderer puts each block of send audio in a lock free ring and wakes the effects thread with a semaphore
+// the effects thread processes it and puts the wet audio in a second ring, and the renderer mixes that in next block
+// so the effects are one block behind the dry sound - 1.5ms at 64 frames
+// if the effects thread falls behind the renderer plays what it has and counts an underrun, it never waits
+// the delay is a tape style stereo delay - changing the time slides the read point so it bends rather than clicks
+// the reverb is an 8 line feedback delay network with a Hadamard mixing matrix and damping in each line
+
+#define FX_RING 4096               // frames in each ring - must be a power of 2
+#define FX_MAXDELAY 2000           // max delay time in ms
+#define FX_DELAYSIZE 131072        // delay buffer - power of 2 and more than FX_MAXDELAY at SAMPLE_RATE
+#define FX_LINES 8                 // reverb delay lines
+#define FX_LINESIZE 4096           // max reverb line length - power of 2
+
+struct fxsendframe {
+	float delayL,delayR;
+	float reverbL,reverbR;
+};
+
+struct fxwetframe {
+	float L,R;
+};
+
+struct fxrings {
+	std::atomic<uint32_t> sendhead;  // written by the renderer
+	std::atomic<uint32_t> sendtail;  // written by the effects thread
+	fxsendframe send[FX_RING];
+	std::atomic<uint32_t> wethead;   // written by the effects thread
+	std::atomic<uint32_t> wettail;   // written by the renderer
+	fxwetframe wet[FX_RING];
+} fxring;
+
+sem_t fxsem;  // counts blocks waiting for the effects thread
+
+// effects settings - the Effects menu changes these
+int16_t fxdelaytime=375;    // ms
+int16_t fxdelayfb=400;      // feedback 0-950
+int16_t fxdelaydamp=300;    // high cut in the feedback 0-1000
+int16_t fxdelaylevel=500;   // return level
+int16_t fxreverbtime=2000;  // ms to die away 60dB
+int16_t fxreverbdamp=400;   // high frequencies die away this much faster
+int16_t fxreverblevel=500;  // return level
+
+// effects state - effects thread only
+float fxdelaybuf[2][FX_DELAYSIZE];
+uint32_t fxdelaypos;
+float fxdelaycur;            // delay time in samples, slides toward the setting
+float fxdelaylp[2];          // feedback filter state
+float fxlines[FX_LINES][FX_LINESIZE];
+uint32_t fxlinepos;
+float fxlinelp[FX_LINES];    // damping filter state
+const int fxlinelen[FX_LINES]={1427,1637,1871,2053,2273,2459,2677,2903};  // samples at 44.1k - no common factors
+
+float fxloadus;              // smoothed processing time per block
+float fxblockus=1;           // length of a block
+std::atomic<int16_t> fxunderruns(0);
+bool fxstarted;              // the first wet audio has come back - before that an empty ring isn't the thread being late
+
+// hand a block of send audio to the effects thread and mix in what it has done - renderer only
+// out is the interleaved mix of outchannels channels, send is this block's send audio
+void fx_block(float *out, const fxsendframe *send, unsigned long frames) {
+	uint32_t head=fxring.sendhead.load(std::memory_order_relaxed);
+	uint32_t tail=fxring.sendtail.load(std::memory_order_acquire);
+	if (FX_RING-(head-tail) >= frames) {  // no room means the effects thread has stopped - drop it
+		for (unsigned long i=0;i<frames;++i) fxring.send[(head+i) & (FX_RING-1)]=send[i];
+		fxring.sendhead.store(head+frames,std::memory_order_release);
+		sem_post(&fxsem);
+	}
+
+	head=fxring.wethead.load(std::memory_order_acquire);
+	tail=fxring.wettail.load(std::memory_order_relaxed);
+	uint32_t avail=head-tail;
+	if (avail > 2*frames) {  // the effects thread was late then caught up - drop the extra so we stay a block behind
+		tail=head-frames;
+		avail=frames;
+	}
+	if (avail > 0) fxstarted=1;
+	if (avail < frames) {
+		if (fxstarted) ++fxunderruns;  // late - play what we have, which may be nothing
+	}
+	else avail=frames;
+	for (uint32_t i=0;i<avail;++i) {
+		fxwetframe *w=&fxring.wet[(tail+i) & (FX_RING-1)];
+		out[i*outchannels]+=w->R;  // the first pair - channel 0 is the right
+		out[i*outchannels+1]+=w->L;
+	}
+	fxring.wettail.store(tail+avail,std::memory_order_release);
+}
+
+void fx_init(void) {
+	sem_init(&fxsem,0,0);
+	fxdelaycur=(float)fxdelaytime*SAMPLE_RATE/1000;
+}
+
+// process n frames of send audio
+void fx_process(uint32_t tail, uint32_t head, uint32_t n) {
+	float dtarget=(float)fxdelaytime*SAMPLE_RATE/1000;
+	if (dtarget > FX_DELAYSIZE-2) dtarget=FX_DELAYSIZE-2;
+	if (dtarget < 1) dtarget=1;
+	float dfb=(float)fxdelayfb/1000;
+	float dlp=1.0f-(float)fxdelaydamp/1000*0.9f;  // one pole low pass coefficient
+	float dlevel=(float)fxdelaylevel/1000;
+	float rlevel=(float)fxreverblevel/1000*0.35f;  // 8 lines add up loud
+	float rgain[FX_LINES],rlp[FX_LINES];
+	int rlen[FX_LINES];
+	float rtime=(float)fxreverbtime/1000;
+	if (rtime < 0.1f) rtime=0.1f;
+	for (int k=0;k<FX_LINES;++k) {
+		rlen[k]=fxlinelen[k]*SAMPLE_RATE/44100;
+		if (rlen[k] > FX_LINESIZE-1) rlen[k]=FX_LINESIZE-1;
+		rgain[k]=powf(10.0f,-3.0f*rlen[k]/(rtime*SAMPLE_RATE));  // -60dB in rtime
+		rlp[k]=1.0f-(float)fxreverbdamp/1000*0.7f;
+	}
+
+	for (uint32_t i=0;i<n;++i) {
+		fxsendframe *s=&fxring.send[(tail+i) & (FX_RING-1)];
+		fxwetframe *w=&fxring.wet[(head+i) & (FX_RING-1)];
+
+		// delay - fractional read so the time can slide
+		fxdelaycur+=(dtarget-fxdelaycur)*0.0002f;
+		float rp=(float)fxdelaypos-fxdelaycur;
+		if (rp < 0) rp+=FX_DELAYSIZE;
+		uint32_t r0=(uint32_t)rp;
+		float f=rp-r0;
+		uint32_t r1=(r0+1) & (FX_DELAYSIZE-1);
+		float dl=fxdelaybuf[0][r0]+(fxdelaybuf[0][r1]-fxdelaybuf[0][r0])*f;
+		float dr=fxdelaybuf[1][r0]+(fxdelaybuf[1][r1]-fxdelaybuf[1][r0])*f;
+		fxdelaylp[0]+=(dl-fxdelaylp[0])*dlp;
+		fxdelaylp[1]+=(dr-fxdelaylp[1])*dlp;
+		fxdelaybuf[0][fxdelaypos]=s->delayL+fxdelaylp[0]*dfb+1e-18f;  // a speck of DC keeps the feedback out of denormals
+		fxdelaybuf[1][fxdelaypos]=s->delayR+fxdelaylp[1]*dfb+1e-18f;
+		fxdelaypos=(fxdelaypos+1) & (FX_DELAYSIZE-1);
+
+		// reverb - read each line, damp it, mix with a Hadamard matrix and feed back with the input
+		float x[FX_LINES];
+		for (int k=0;k<FX_LINES;++k) {
+			float v=fxlines[k][(fxlinepos-rlen[k]) & (FX_LINESIZE-1)];
+			fxlinelp[k]+=(v-fxlinelp[k])*rlp[k];
+			x[k]=fxlinelp[k]*rgain[k];
+		}
+		float outL=x[0]+x[2]+x[4]+x[6];
+		float outR=x[1]+x[3]+x[5]+x[7];
+		for (int h=1;h<FX_LINES;h<<=1) {  // fast Hadamard transform
+			for (int k=0;k<FX_LINES;k+=2*h) {
+				for (int j=k;j<k+h;++j) {
+					float a=x[j],b=x[j+h];
+					x[j]=a+b;
+					x[j+h]=a-b;
+				}
+			}
+		}
+		for (int k=0;k<FX_LINES;++k) {
+			float in=(k & 1) ? s->reverbR : s->reverbL;
+			fxlines[k][fxlinepos & (FX_LINESIZE-1)]=x[k]*0.35355339f+in+1e-18f;  // 1/sqrt(8) keeps the matrix lossless
+		}
+		++fxlinepos;
+
+		w->L=dl*dlevel+outL*rlevel;
+		w->R=dr*dlevel+outR*rlevel;
+	}
+}
+
+// effects thread - waits for send audio, processes it as soon as it arrives
+void *fxthread(void *threadid) {
+	struct sched_param param;
+	struct timespec t0,t1;
+	cpu_set_t cpus;
+
+	int cpu=sysconf(_SC_NPROCESSORS_ONLN)-1;  // keep off the core the audio thread usually lands on
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu,&cpus);
+	pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+	param.sched_priority=60;  // below the audio thread, above the fast CV
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);  // fails quietly if we are not root
+
+	while (1) {
+		sem_wait(&fxsem);
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		uint32_t tail=fxring.sendtail.load(std::memory_order_relaxed);
+		uint32_t head=fxring.sendhead.load(std::memory_order_acquire);
+		uint32_t n=head-tail;
+		if (n == 0) continue;  // got it on the last pass
+		uint32_t wet=fxring.wethead.load(std::memory_order_relaxed);
+		fx_process(tail,wet,n);
+		fxring.wethead.store(wet+n,std::memory_order_release);
+		fxring.sendtail.store(head,std::memory_order_release);
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		float us=(t1.tv_sec-t0.tv_sec)*1e6f+(t1.tv_nsec-t0.tv_nsec)/1000.0f;
+		fxloadus+=(us-fxloadus)*0.05f;
+		fxblockus=(float)n*1000000/SAMPLE_RATE;
+	}
+	return 0;  // will never get here
+}
@@ -0,0 +1,203 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// granular voices - lots of short windowed grains taken from the slot's sample
+// Grain Pos sets where in the sample the grains come from, as an offset ahead of the playhead
+// the playhead moves at the slot's speed so speed 0 freezes the sound and 1.00 plays through it at the normal rate
+// Density is grains started per second, Grain Size is their length and Spray moves each one a random amount
+// pitch is the usual transpose/MIDI note/pitch CV and doesn't change the speed
+// all of them can follow a CV like the other parameters
+// grains come from a fixed pool so nothing is allocated on the audio thread - if the pool runs out new grains are skipped
+// each grain is rendered in three passes: work out the read positions and window points, fetch the samples, then
+// window and interpolate - the last pass is straight float math the compiler vectorizes
+
+#define GRAIN_POOL 128          // grains playing at once across all the slots
+#define GRAIN_WINDOW 1024       // window table size
+#define GRAIN_MAXDENSITY 500    // grains per second
+#define GRAIN_MINSIZE 5         // grain length in ms
+#define GRAIN_MAXSIZE 1000
+#define GRAIN_MAXSPRAY 1000     // ms
+
+struct grain {
+	int16_t slot;       // slot the grain belongs to, -1 = free
+	double pos;         // read position in the sample
+	float step;         // sample increment per output sample - the pitch, negative is backwards
+	int32_t age;        // output samples done
+	int32_t len;        // grain length in output samples
+	int32_t delay;      // samples into the block before it starts - only for its first block
+	float winstep;      // window table step per output sample
+	float gain;
+} grains[GRAIN_POOL];
+
+float grainwindow[GRAIN_WINDOW+1];  // Hann
+double grainnext[NUMSAMPLES];       // samples till each slot starts its next grain
+uint32_t grainseed=1;               // for the spray
+int grainsactive;                   // for the status display
+float grainus;                      // render time of all the granular voices in the last block
+float grainload;                    // smoothed percent of the block time
+
+void grain_init(void) {
+	for (int i=0;i<=GRAIN_WINDOW;++i) grainwindow[i]=0.5f-0.5f*cosf(2*M_PI*i/GRAIN_WINDOW);
+	for (int g=0;g<GRAIN_POOL;++g) grains[g].slot=-1;
+}
+
+// count the grains playing and average what the last block cost - called once per block after stretch_begin()
+// grains of a slot that has been switched off Grains, by the menu or a kit, are freed here since grain_render()
+// won't be called for it any more
+void grain_begin(void) {
+	int n=0;
+	for (int g=0;g<GRAIN_POOL;++g) {
+		if (grains[g].slot < 0) continue;
+		if (samp[grains[g].slot].voice != VOICEGRAINS) grains[g].slot=-1;
+		else ++n;
+	}
+	grainsactive=n;
+	grainload+=(grainus*100/stretchblockus-grainload)*0.05f;
+	grainus=0;
+}
+
+// random number -1.0 to 1.0 - xorshift, cheap and good enough for spray
+float grain_random(void) {
+	grainseed^=grainseed<<13;
+	grainseed^=grainseed>>17;
+	grainseed^=grainseed<<5;
+	return (float)grainseed/2147483648.0f-1.0f;
+}
+
+// start a grain for slot s delay samples into this block
+void grain_start(int s, int32_t delay) {
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	int g;
+	for (g=0;g<GRAIN_POOL;++g) if (grains[g].slot < 0) break;
+	if ((g == GRAIN_POOL) || (size < 2)) return;  // pool is full - skip it
+
+	grain *gr=&grains[g];
+	gr->len=samp[s].grainsize*SAMPLE_RATE/1000;
+	if (gr->len < 16) gr->len=16;
+	gr->step=pitchratio[s];
+	if (samp[s].speed < 0) gr->step=-gr->step;
+	double centre=samp[s].phasor+(double)samp[s].grainpos/1000;  // grain position is ahead of the playhead
+	centre-=floor(centre);
+	centre=centre*size+grain_random()*samp[s].spray*SAMPLE_RATE/1000;
+	gr->pos=centre-gr->len*gr->step/2;  // centre the grain on its position
+	gr->age=0;
+	gr->delay=delay;
+	gr->winstep=(float)GRAIN_WINDOW/gr->len;
+	float overlap=(float)samp[s].density*samp[s].grainsize/1000;  // grains playing at once in this slot
+	gr->gain=(overlap > 1.0f) ? 1.0f/sqrtf(overlap) : 1.0f;  // grains at random positions add up like noise
+	gr->slot=s;
+}
+
+// add one grain to the output - n samples starting at out
+void grain_kernel(grain *gr, const double *srcR, const double *srcL, int32_t size, float *outR, float *outL, int n) {
+	int32_t idx[MAXFRAMES];
+	float frac[MAXFRAMES],w[MAXFRAMES];
+	float r0[MAXFRAMES],r1[MAXFRAMES],l0[MAXFRAMES],l1[MAXFRAMES];
+	int i;
+
+	int32_t base=(int32_t)floor(gr->pos);
+	float offset=(float)(gr->pos-base);
+	float wpos=gr->age*gr->winstep;
+	for (i=0;i<n;++i) {  // positions and window points
+		float p=offset+i*gr->step;
+		float fl=floorf(p);
+		idx[i]=base+(int32_t)fl;
+		frac[i]=p-fl;
+		w[i]=wpos+i*gr->winstep;
+	}
+	for (i=0;i<n;++i) {  // fetch - clamped so a grain off the end of the sample just holds the last sample
+		int32_t j=idx[i];
+		if (j < 0) j=0;
+		if (j > size-2) j=size-2;
+		r0[i]=srcR[j];
+		r1[i]=srcR[j+1];
+		l0[i]=srcL[j];
+		l1[i]=srcL[j+1];
+		int k=(int)w[i];
+		w[i]=grainwindow[(k < GRAIN_WINDOW) ? k : GRAIN_WINDOW]*gr->gain;
+	}
+	for (i=0;i<n;++i) {  // window and interpolate
+		outR[i]+=w[i]*(r0[i]+(r1[i]-r0[i])*frac[i]);
+		outL[i]+=w[i]*(l0[i]+(l1[i]-l0[i])*frac[i]);
+	}
+	gr->pos+=n*(double)gr->step;
+	gr->age+=n;
+}
+
+// render a block of a granular voice - schedules new grains while the slot is playing and plays out the ones it has
+void grain_render(int s, float *outL, float *outR, unsigned long frames) {
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	struct timespec t0,t1;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	memset(outL,0,frames*sizeof(float));
+	memset(outR,0,frames*sizeof(float));
+	if (size < 2) return;
+
+	if (samp[s].state == PLAYING) {
+		double period=(double)SAMPLE_RATE/(samp[s].density > 0 ? samp[s].density : 1);
+		if (grainnext[s] > period) grainnext[s]=period;  // density went up
+		while (grainnext[s] < frames) {
+			grain_start(s,(int32_t)grainnext[s]);
+			grainnext[s]+=period;
+		}
+		grainnext[s]-=frames;
+
+		samp[s].phasor+=samp[s].phaseinc*frames;  // move the playhead - same end of sample rules as the normal voice
+		if (samp[s].phasor >= 1.0) {
+			samp[s].phasor-=1.0;
+			if (samp[s].mode == TRIGGERED) samp[s].state=SILENT;
+		}
+		if (samp[s].phasor < 0) {
+			samp[s].phasor+=1.0;
+			if (samp[s].mode == TRIGGERED) samp[s].state=SILENT;
+		}
+		if (samp[s].state == SILENT) sliceplay[s].on=0;
+	}
+	else grainnext[s]=0;  // first grain starts right away next time
+
+	const double *srcR=audioFile[s].samples[0].data();
+	const double *srcL=audioFile[s].samples[audioFile[s].getNumChannels()-1].data();
+	for (int g=0;g<GRAIN_POOL;++g) {  // grains carry on after the slot stops
+		grain *gr=&grains[g];
+		if (gr->slot != s) continue;
+		int32_t start=gr->delay;
+		gr->delay=0;
+		while (start < (int32_t)frames) {  // kernel works in MAXFRAMES chunks
+			int32_t n=frames-start;
+			if (n > gr->len-gr->age) n=gr->len-gr->age;
+			if (n > MAXFRAMES) n=MAXFRAMES;
+			if (n <= 0) break;
+			grain_kernel(gr,srcR,srcL,size,outR+start,outL+start,n);
+			start+=n;
+		}
+		if (gr->age >= gr->len) gr->slot=-1;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	grainus+=(t1.tv_sec-t0.tv_sec)*1e6f+(t1.tv_nsec-t0.tv_nsec)/1000.0f;
+}
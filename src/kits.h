@@ -0,0 +1,479 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// kit presets - the filenames and settings of all 8 sample slots
+// kits are text files in KIT_DIR, one "key=value" per line, so they can be edited by hand
+// the keys come from the kitkeys table below - unknown keys are skipped and missing ones keep their current value
+// so kits saved by an older or newer version still load
+//
+// loading a kit is done by a background thread so the current kit keeps playing while the new samples load
+// when they are all in memory the audio callback swaps them in at the start of a block - just pointer swaps
+// then the loader frees the old kit's audio. only the keys the kit file has are applied, so menu edits made
+// while a kit was loading stay put
+// samples picked in the file menu go through the same loader as a one slot change so the callback never sees
+// a half loaded sample
+// MIDI program changes select kits too - program 0 is kit 1
+
+#define KIT_DIR "./kits"
+#define KIT_VERSION 1   // bump if the meaning of a key changes
+#define KIT_MAX 99      // kits are numbered 1-99
+
+// sample settings saved in a kit - all int16 like the menus
+struct kitkey {
+	const char *name;
+	size_t offset;  // offset of the parameter in sampleinfo
+};
+
+kitkey kitkeys[] = {
+	"level",offsetof(sampleinfo,level),
+	"pan",offsetof(sampleinfo,pan),
+	"mode",offsetof(sampleinfo,mode),
+	"speed",offsetof(sampleinfo,speed),
+	"transpose",offsetof(sampleinfo,transpose),
+	"midichannel",offsetof(sampleinfo,midichannel),
+	"note",offsetof(sampleinfo,note),
+	"midimode",offsetof(sampleinfo,midimode),
+	"levelcv",offsetof(sampleinfo,levelCV),
+	"pancv",offsetof(sampleinfo,panCV),
+	"speedcv",offsetof(sampleinfo,speedCV),
+	"pitchcv",offsetof(sampleinfo,pitchCV),
+	"fastcv",offsetof(sampleinfo,fastCV),
+	"fastmode",offsetof(sampleinfo,fastmode),
+	"fmdepth",offsetof(sampleinfo,fmdepth),
+	"quantize",offsetof(sampleinfo,quantize),
+	"start",offsetof(sampleinfo,start),
+	"syncbeats",offsetof(sampleinfo,syncbeats),
+	"loopstart",offsetof(sampleinfo,loopstart),
+	"loopend",offsetof(sampleinfo,loopend),
+	"slicemode",offsetof(sampleinfo,slicemode),
+	"slicecv",offsetof(sampleinfo,sliceCV),
+	"voice",offsetof(sampleinfo,voice),
+	"grainpos",offsetof(sampleinfo,grainpos),
+	"grainposcv",offsetof(sampleinfo,grainposCV),
+	"density",offsetof(sampleinfo,density),
+	"densitycv",offsetof(sampleinfo,densityCV),
+	"grainsize",offsetof(sampleinfo,grainsize),
+	"grainsizecv",offsetof(sampleinfo,grainsizeCV),
+	"spray",offsetof(sampleinfo,spray),
+	"spraycv",offsetof(sampleinfo,sprayCV),
+	"filter",offsetof(sampleinfo,filter),
+	"cutoff",offsetof(sampleinfo,cutoff),
+	"cutoffcv",offsetof(sampleinfo,cutoffCV),
+	"resonance",offsetof(sampleinfo,resonance),
+	"resonancecv",offsetof(sampleinfo,resonanceCV),
+	"delaysend",offsetof(sampleinfo,delaysend),
+	"reverbsend",offsetof(sampleinfo,reverbsend),
+	"output",offsetof(sampleinfo,output),
+};
+
+#define NUM_KITKEYS (int)(sizeof(kitkeys)/sizeof(kitkey))
+
+// keys that have been renamed - kits saved under the old name still load
+const char *kitaliases[][2] = {
+	{"stretch","voice"},  // the Stretch switch became the Voice setting - 0 and 1 mean the same
+};
+
+#define NUM_KITALIASES (int)(sizeof(kitaliases)/sizeof(kitaliases[0]))
+static_assert(NUM_KITKEYS <= 64,"kit key masks are 64 bits");
+#define KIT_ALLKEYS (~(uint64_t)0)
+#define KIT_SWAPWAIT 500  // ms to wait for the audio callback to swap a kit in before doing it ourselves
+
+enum kitstates {KIT_IDLE,KIT_LOADING,KIT_READY,KIT_SWAPPING,KIT_SWAPPED};
+
+sampleinfo kitsamp[NUMSAMPLES];           // settings of the kit being loaded
+uint64_t kitset[NUMSAMPLES];              // bit per kitkeys[] entry the kit sets for each slot
+sampleinfo kitoldsamp[NUMSAMPLES];        // settings just before the swap - so the old kit can be cached
+AudioFile<double> kitaudio[NUMSAMPLES];   // its samples - after the swap this holds the old kit's samples until they are freed
+slicelist kitslices[NUMSAMPLES];          // and their slices
+bool kitnew[NUMSAMPLES];                  // slot has a different sample in the new kit
+std::atomic<int8_t> kitstate(KIT_IDLE);
+std::atomic<int8_t> kitprogress(0);       // number of slots loaded so far
+
+#define KIT_CACHE 2     // number of kits that can be prefetched
+
+struct kitcacheentry {
+	int16_t kit;                        // kit number in this entry, 0=empty
+	sampleinfo samp[NUMSAMPLES];
+	uint64_t set[NUMSAMPLES];           // keys the kit sets
+	AudioFile<double> audio[NUMSAMPLES];
+	slicelist slices[NUMSAMPLES];
+	bool have[NUMSAMPLES];              // audio[] holds the sample for the slot
+} kitcache[KIT_CACHE];
+
+int16_t kitprefetch=1;     // keep the next and previous kits loaded
+int16_t kitchannel=0;      // MIDI channel for program changes, 0=off
+int16_t kitcurrent=0;      // kit that is playing, 0=none
+int16_t kitloading=0;      // kit being loaded - for the display. -1 to -8 is a sample for slot 1-8
+int16_t kitrequest=0;  // kit the loader should load next, 0=none
+bool irrequest=0;      // loader should load the reverb IR in irfilename
+int16_t slotrequest=-1;     // slot the loader should load slotfile into, -1=none
+char slotfile[PATHLEN];     // relative to filesroot
+bool looprequest=0;         // loader should rebuild the sustain loops - the loop points were edited
+pthread_mutex_t kitlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t kitcond = PTHREAD_COND_INITIALIZER;
+
+void kit_path(int n, char *out) {
+	snprintf(out,PATHLEN,"%s/kit%02d.txt",KIT_DIR,n);
+}
+
+// read kit n into dest - dest should hold the current settings since a kit doesn't have to have every key
+// set gets a bit for each key found in each slot, it can be NULL
+bool kit_read(int n, sampleinfo *dest, uint64_t *set) {
+	char temp[PATHLEN],line[PATHLEN+32];
+	int version,slot=-1;
+
+	kit_path(n,temp);
+	FILE *f=fopen(temp,"r");
+	if (f == NULL) return 0;
+	if (set != NULL) memset(set,0,NUMSAMPLES*sizeof(uint64_t));
+	if ((fgets(line,sizeof(line),f) == NULL) || (sscanf(line,"sampleplayer kit %d",&version) != 1) || (version > KIT_VERSION)) {
+		printf("%s is not a kit I understand\n",temp);
+		fclose(f);
+		return 0;
+	}
+	while (fgets(line,sizeof(line),f) != NULL) {
+		line[strcspn(line,"\r\n")]=0;
+		char *value=strchr(line,'=');
+		if ((line[0] == '#') || (value == NULL)) continue;
+		*value++=0;
+		if (!strcmp(line,"slot")) {
+			slot=atoi(value)-1;
+			if ((slot < 0) || (slot >= NUMSAMPLES)) slot=-1;
+			continue;
+		}
+		if (slot < 0) continue;
+		const char *key=line;
+		for (int k=0;k<NUM_KITALIASES;++k) if (!strcmp(key,kitaliases[k][0])) key=kitaliases[k][1];
+		if (!strcmp(key,"file")) {
+			snprintf(dest[slot].filename,PATHLEN,"%s",value);
+			continue;
+		}
+		for (int k=0;k<NUM_KITKEYS;++k) {
+			if (!strcmp(key,kitkeys[k].name)) {
+				*(int16_t *)((char *)&dest[slot]+kitkeys[k].offset)=atoi(value);
+				if (set != NULL) set[slot]|=(uint64_t)1<<k;
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+// save the current settings as kit n
+bool kit_write(int n) {
+	char temp[PATHLEN];
+	mkdir(KIT_DIR,0755);  // in case this is the first one
+	kit_path(n,temp);
+	FILE *f=fopen(temp,"w");
+	if (f == NULL) {
+		printf("Can't write %s\n",temp);
+		return 0;
+	}
+	fprintf(f,"sampleplayer kit %d\n",KIT_VERSION);
+	for (int s=0;s<NUMSAMPLES;++s) {
+		fprintf(f,"slot=%d\n",s+1);
+		fprintf(f,"file=%s\n",samp[s].filename);
+		for (int k=0;k<NUM_KITKEYS;++k) fprintf(f,"%s=%d\n",kitkeys[k].name,*(int16_t *)((char *)&samp[s]+kitkeys[k].offset));
+	}
+	fclose(f);
+	return 1;
+}
+
+// ask the loader thread to load kit n - returns right away
+void kit_request(int16_t n) {
+	pthread_mutex_lock(&kitlock);
+	kitrequest=n;
+	pthread_cond_signal(&kitcond);
+	pthread_mutex_unlock(&kitlock);
+}
+
+// ask the loader thread to load a sample into slot s - returns right away
+void slot_request(int s, const char *file) {
+	pthread_mutex_lock(&kitlock);
+	snprintf(slotfile,PATHLEN,"%s",file);
+	slotrequest=s;
+	pthread_cond_signal(&kitcond);
+	pthread_mutex_unlock(&kitlock);
+}
+
+// ask the loader thread to rebuild the sustain loop crossfades - returns right away
+void loop_request(void) {
+	pthread_mutex_lock(&kitlock);
+	looprequest=1;
+	pthread_cond_signal(&kitcond);
+	pthread_mutex_unlock(&kitlock);
+}
+
+// ask the loader thread to load the reverb IR - returns right away
+void ir_request(void) {
+	pthread_mutex_lock(&kitlock);
+	irrequest=1;
+	pthread_cond_signal(&kitcond);
+	pthread_mutex_unlock(&kitlock);
+}
+
+// wake the loader up to look at the prefetch setting
+void kit_wake(void) {
+	pthread_mutex_lock(&kitlock);
+	pthread_cond_signal(&kitcond);
+	pthread_mutex_unlock(&kitlock);
+}
+
+// swap the audio and slices of two samples - no allocation
+void kit_swapaudio(AudioFile<double> &a, slicelist &asl, AudioFile<double> &b, slicelist &bsl) {
+	a.samples.swap(b.samples);
+	std::swap(a.loopStart,b.loopStart);
+	std::swap(a.loopEnd,b.loopEnd);
+	std::swap(asl,bsl);
+}
+
+// swap in a kit that has finished loading - called by the audio callback between blocks, or by the loader if
+// the audio isn't running. only swaps vectors and copies settings so it's quick and never allocates
+// slots that get a new sample are stopped, the others carry on playing with their new settings
+void kit_swap(void) {
+	int8_t ready=KIT_READY;
+	if (!kitstate.compare_exchange_strong(ready,KIT_SWAPPING)) return;  // nothing to do or the other thread has it
+	memcpy(kitoldsamp,samp,sizeof(kitoldsamp));
+	for (int s=0;s<NUMSAMPLES;++s) {
+		if (kitnew[s]) {
+			kit_swapaudio(audioFile[s],sampleslices[s],kitaudio[s],kitslices[s]);
+			strcpy(samp[s].filename,kitsamp[s].filename);
+			sliceplay[s].step=0;
+			samp[s].phasor=0.0;
+			samp[s].state=SILENT;
+		}
+		for (int k=0;k<NUM_KITKEYS;++k) {  // just the settings the kit has
+			if (!(kitset[s] & ((uint64_t)1<<k))) continue;
+			*(int16_t *)((char *)&samp[s]+kitkeys[k].offset)=*(int16_t *)((char *)&kitsamp[s]+kitkeys[k].offset);
+		}
+	}
+	kitstate=KIT_SWAPPED;
+}
+
+// hand a loaded kit to the audio callback and wait for it to be swapped in
+void kit_handover(void) {
+	kitstate=KIT_READY;
+	for (int t=0;kitstate != KIT_SWAPPED;++t) {  // audio callback swaps it in on the next block
+		usleep(1000);
+		if (t >= KIT_SWAPWAIT) kit_swap();  // audio is stopped - eg the buffer is being changed
+	}
+}
+
+// load a sample picked in the file menu into slot s
+void slot_load(int s, const char *file) {
+	char temp[PATHLEN];
+	kitstate=KIT_LOADING;
+	kitloading=-(s+1);
+	kitprogress=0;
+	memset(kitnew,0,sizeof(kitnew));
+	memset(kitset,0,sizeof(kitset));  // no settings change
+	snprintf(kitsamp[s].filename,PATHLEN,"%s",file);
+	snprintf(temp,PATHLEN,"%s/%s",filesroot,file);
+	if (!kitaudio[s].load(temp)) {
+		printf("can't load %s\n",temp);
+		kitstate=KIT_IDLE;
+		return;
+	}
+	slice_detect(kitaudio[s],&kitslices[s]);
+	kitnew[s]=1;
+	kit_handover();
+	loops_build();
+	AudioFile<double>::AudioBuffer().swap(kitaudio[s].samples);  // the old sample - not allowed in the callback
+	kitstate=KIT_IDLE;
+}
+
+// kit cache - with prefetch on, the loader keeps the kits either side of the current one in memory
+// so stepping through kits with program changes during a set is instant
+// only samples that differ from the current kit are kept
+
+// load the samples of kit n that we don't already have into cache entry c
+// gives up early if a kit is requested so we never hold up a switch
+void kit_prefetch(int c, int16_t n) {
+	char temp[PATHLEN];
+	kitcacheentry *k=&kitcache[c];
+
+	if (k->kit != n) {  // reuse the entry
+		for (int s=0;s<NUMSAMPLES;++s) {
+			AudioFile<double>::AudioBuffer().swap(k->audio[s].samples);
+			k->have[s]=0;
+		}
+		memcpy(k->samp,samp,sizeof(k->samp));
+		k->kit=0;
+		if (!kit_read(n,k->samp,k->set)) return;  // no such kit
+		k->kit=n;
+	}
+	for (int s=0;s<NUMSAMPLES;++s) {
+		if (kitrequest != 0) return;  // something to do that's more important
+		if (k->have[s] || !strcmp(k->samp[s].filename,samp[s].filename)) continue;
+		snprintf(temp,PATHLEN,"%s/%s",filesroot,k->samp[s].filename);
+		k->have[s]=k->audio[s].load(temp);
+		if (k->have[s]) slice_detect(k->audio[s],&k->slices[s]);
+	}
+}
+
+// which cache entry has kit n, or -1
+int kit_cached(int16_t n) {
+	for (int c=0;c<KIT_CACHE;++c) if (kitcache[c].kit == n) return c;
+	return -1;
+}
+
+// kit loader thread
+void *kitthread(void *threadid) {
+	char temp[PATHLEN];
+	int16_t n;
+	int c;
+
+	while (1) {
+		pthread_mutex_lock(&kitlock);
+		while ((kitrequest == 0) && !irrequest && (slotrequest < 0) && !looprequest) {
+			if (kitprefetch && (kitcurrent > 0)) {  // nothing to load - make sure the neighbours are resident
+				int16_t want[2]={(int16_t)(kitcurrent+1),(int16_t)(kitcurrent-1)};
+				pthread_mutex_unlock(&kitlock);
+				for (int w=0;w<2;++w) {
+					if ((want[w] < 1) || (want[w] > KIT_MAX)) continue;
+					c=kit_cached(want[w]);
+					if (c < 0) {  // use an entry that isn't holding the other neighbour
+						c=0;
+						while ((c < KIT_CACHE-1) && ((kitcache[c].kit == want[0]) || (kitcache[c].kit == want[1]))) ++c;
+					}
+					kit_prefetch(c,want[w]);
+				}
+				pthread_mutex_lock(&kitlock);
+				if ((kitrequest != 0) || irrequest || (slotrequest >= 0) || looprequest) break;
+			}
+			else if (!kitprefetch) {  // prefetch was turned off - give the memory back
+				pthread_mutex_unlock(&kitlock);
+				for (c=0;c<KIT_CACHE;++c) {
+					for (int s=0;s<NUMSAMPLES;++s) {
+						AudioFile<double>::AudioBuffer().swap(kitcache[c].audio[s].samples);
+						kitcache[c].have[s]=0;
+					}
+					kitcache[c].kit=0;
+				}
+				pthread_mutex_lock(&kitlock);
+				if ((kitrequest != 0) || irrequest || (slotrequest >= 0) || looprequest) break;
+			}
+			pthread_cond_wait(&kitcond,&kitlock);
+		}
+		if (irrequest) {  // IRs are quick - do them first
+			irrequest=0;
+			pthread_mutex_unlock(&kitlock);
+			conv_load();
+			continue;
+		}
+		if (looprequest) {  // quick too
+			looprequest=0;
+			pthread_mutex_unlock(&kitlock);
+			loops_build();
+			continue;
+		}
+		if (slotrequest >= 0) {  // a sample from the file menu
+			int s=slotrequest;
+			char file[PATHLEN];
+			strcpy(file,slotfile);
+			slotrequest=-1;
+			pthread_mutex_unlock(&kitlock);
+			slot_load(s,file);
+			continue;
+		}
+		n=kitrequest;
+		kitrequest=0;
+		pthread_mutex_unlock(&kitlock);
+
+		kitstate=KIT_LOADING;
+		kitloading=n;
+		kitprogress=0;
+		c=kit_cached(n);
+		if (c >= 0) {
+			memcpy(kitsamp,kitcache[c].samp,sizeof(kitsamp));
+			memcpy(kitset,kitcache[c].set,sizeof(kitset));
+		}
+		else {
+			memcpy(kitsamp,samp,sizeof(kitsamp));  // start from what we have now
+			if (!kit_read(n,kitsamp,kitset)) {
+				printf("Can't load kit %d\n",n);
+				kitstate=KIT_IDLE;
+				continue;
+			}
+		}
+		for (int s=0;s<NUMSAMPLES;++s) {
+			kitnew[s]=strcmp(kitsamp[s].filename,samp[s].filename) != 0;  // no need to reload a sample we already have
+			if (kitnew[s]) {
+				if ((c >= 0) && kitcache[c].have[s] && !strcmp(kitcache[c].samp[s].filename,kitsamp[s].filename)) {
+					kit_swapaudio(kitaudio[s],kitslices[s],kitcache[c].audio[s],kitcache[c].slices[s]);  // prefetched
+					kitcache[c].have[s]=0;
+				}
+				else {
+					snprintf(temp,PATHLEN,"%s/%s",filesroot,kitsamp[s].filename);
+					if (!kitaudio[s].load(temp)) {  // keep the old sample rather than play silence
+						printf("kit %d: can't load %s\n",n,temp);
+						strcpy(kitsamp[s].filename,samp[s].filename);
+						kitnew[s]=0;
+					}
+					else slice_detect(kitaudio[s],&kitslices[s]);
+				}
+			}
+			kitprogress=s+1;
+		}
+		if (c >= 0) kitcache[c].kit=0;  // used up
+
+		int16_t oldkit=kitcurrent;
+		kit_handover();
+		loops_build();  // new samples or loop points
+		kitcurrent=n;
+
+		// the old kit's samples are in kitaudio now - keep them in the cache if we might go back, otherwise free them
+		c=-1;
+		if (kitprefetch && (oldkit > 0) && ((oldkit == n-1) || (oldkit == n+1))) {
+			c=kit_cached(oldkit);
+			if (c < 0) {
+				c=0;
+				while ((c < KIT_CACHE-1) && ((kitcache[c].kit == n-1) || (kitcache[c].kit == n+1))) ++c;
+			}
+			for (int s=0;s<NUMSAMPLES;++s) {
+				AudioFile<double>::AudioBuffer().swap(kitcache[c].audio[s].samples);
+				kitcache[c].have[s]=0;
+			}
+			memcpy(kitcache[c].samp,kitoldsamp,sizeof(kitoldsamp));
+			for (int s=0;s<NUMSAMPLES;++s) kitcache[c].set[s]=KIT_ALLKEYS;  // going back restores all of it
+			kitcache[c].kit=oldkit;
+		}
+		for (int s=0;s<NUMSAMPLES;++s) {  // free what we don't keep - not allowed in the callback
+			if (!kitnew[s]) continue;
+			if (c >= 0) {
+				kit_swapaudio(kitcache[c].audio[s],kitcache[c].slices[s],kitaudio[s],kitslices[s]);
+				kitcache[c].have[s]=1;
+			}
+			else AudioFile<double>::AudioBuffer().swap(kitaudio[s].samples);
+		}
+		kitstate=KIT_IDLE;
+		printf("kit %d loaded\n",n);
+	}
+	return 0;  // will never get here
+}
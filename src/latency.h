@@ -0,0 +1,137 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// output latency auto tuning
+// the buffer settings are a ladder of period size and count, smallest first. the backends count underruns in xruns and
+// audio_render() keeps track of how much of each buffer's time the rendering takes
+// once a second latency_tune() looks at the underruns over the last minute and the load - more than xruntarget underruns
+// and it steps up the ladder, a minute with none and plenty of headroom and it tries a step down
+// a step that gave trouble - underruns, or the device wouldn't take it - isn't tried again for LATENCY_HOLD seconds,
+// twice that if it fails again and so on, so it doesn't keep bouncing off the same setting
+// the step is saved in LATENCY_FILE whenever it changes so the next boot starts where this one ended up
+// with no file we start at the bottom of the ladder and let it find its way up
+// the PortAudio stream is restarted by the main loop when the step changes, the ALSA thread sets itself up again
+
+#define LATENCY_FILE "./latency.txt"
+#define LATENCY_WINDOW 60   // seconds of underrun history
+#define LATENCY_QUIET 60    // seconds with no underruns before trying a smaller buffer
+#define LATENCY_HOLD 600    // seconds a step that gave trouble is left alone
+#define LATENCY_LOWLOAD 0.5f   // only step down if rendering takes less than this much of the buffer time
+
+struct latencysetting {
+	uint16_t period;   // frames
+	uint8_t periods;
+};
+
+const latencysetting latencysteps[]={{32,2},{64,2},{64,3},{128,2},{128,3},{256,2},{256,3},{512,2}};
+#define LATENCY_STEPS ((int)(sizeof(latencysteps)/sizeof(latencysetting)))
+
+int16_t latencystep=1;       // step the backends should be using - the menu can change it when auto is off
+int16_t latencyauto=1;       // let latency_tune() pick the step
+int16_t xruntarget=1;        // underruns per minute we put up with
+std::atomic<uint32_t> xruns(0);  // output underruns - counted by the backends
+std::atomic<int> latencyrefused(-1);  // step the backend couldn't set the device up for - latency_tune() holds it
+float audioload;             // peak fraction of the buffer time the rendering takes, dies away slowly
+
+// step with the smallest buffer that's at least period x periods frames
+int latency_find(int period, int periods) {
+	for (int k=0;k<LATENCY_STEPS;++k) if (latencysteps[k].period*latencysteps[k].periods >= period*periods) return k;
+	return LATENCY_STEPS-1;
+}
+
+void latency_load(void) {
+	int period,periods;
+	FILE *f=fopen(LATENCY_FILE,"r");
+	if (f == NULL) {
+		latencystep=0;  // find the smallest that works
+		return;
+	}
+	if (fscanf(f,"%d %d",&period,&periods) == 2) latencystep=latency_find(period,periods);
+	fclose(f);
+}
+
+void latency_save(void) {
+	FILE *f=fopen(LATENCY_FILE,"w");
+	if (f == NULL) {
+		printf("Can't write %s\n",LATENCY_FILE);
+		return;
+	}
+	fprintf(f,"%d %d\n",latencysteps[latencystep].period,latencysteps[latencystep].periods);
+	fclose(f);
+}
+
+// keep track of how long the rendering takes - t0 is when the buffer was started
+void latency_load_measure(struct timespec *t0, unsigned long frames) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	float us=(t1.tv_sec-t0->tv_sec)*1e6f+(t1.tv_nsec-t0->tv_nsec)/1000.0f;
+	float load=us*SAMPLE_RATE/((float)frames*1000000);
+	if (load > audioload) audioload=load;
+	else audioload+=(load-audioload)*0.001f;
+}
+
+// call once a second - returns 1 if it moved to a different step
+bool latency_tune(void) {
+	static uint32_t lastxruns=0;
+	static uint16_t history[LATENCY_WINDOW];  // underruns in each of the last LATENCY_WINDOW seconds
+	static int pos=0;
+	static int quiet=0;
+	static int hold[LATENCY_STEPS];
+	static int fails[LATENCY_STEPS];
+	int k,rate=0;
+
+	uint32_t x=xruns;
+	history[pos]=x-lastxruns;
+	lastxruns=x;
+	pos=(pos+1)%LATENCY_WINDOW;
+	for (k=0;k<LATENCY_WINDOW;++k) rate+=history[k];
+	if (history[(pos+LATENCY_WINDOW-1)%LATENCY_WINDOW] != 0) quiet=0;
+	else ++quiet;
+	for (k=0;k<LATENCY_STEPS;++k) if (hold[k] > 0) --hold[k];
+	k=latencyrefused.exchange(-1);
+	if (k >= 0) {  // held like one that had underruns so we don't drain and set up again every quiet minute
+		hold[k]=LATENCY_HOLD<<std::min(fails[k],4);
+		++fails[k];
+	}
+	if (!latencyauto) return 0;
+
+	int step=latencystep;
+	if ((rate > xruntarget) && (step < LATENCY_STEPS-1)) {
+		hold[step]=LATENCY_HOLD<<std::min(fails[step],4);  // this one isn't good enough for a while
+		++fails[step];
+		++step;
+	}
+	else if ((quiet >= LATENCY_QUIET) && (audioload < LATENCY_LOWLOAD) && (step > 0) && (hold[step-1] == 0)) --step;
+	if (step == latencystep) return 0;
+	memset(history,0,sizeof(history));  // judge the new step on its own
+	quiet=0;
+	audioload=0;
+	latencystep=step;
+	printf("latency step %d: %d x %d frames\n",step,latencysteps[step].period,latencysteps[step].periods);
+	return 1;
+}
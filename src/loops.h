@@ -0,0 +1,161 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// sustain loops
+// loop points come from the file (WAV smpl or AIFF INST/MARK) or the Loop Start/End menu items, which win if they're set
+// in GATED play mode or PITCHED MIDI mode a slot with a loop plays into the loop and round it while the gate or note is held
+// then plays out the rest of the sample when it's released
+// to hide the splice the end of the loop is crossfaded into the audio just before the loop start
+// the crossfaded samples are worked out by the kit loader thread whenever the loop or the sample changes and kept in xf[]
+// the renderer just reads them instead of the sample data when it's in that region so there is no crossfade math per sample
+// there are two banks so the loader builds into the one the renderer isn't using and then switches them over
+
+#define LOOP_XFADE 1024  // max crossfade length in samples
+
+struct loopbank {
+	int32_t start;       // first sample of the loop
+	int32_t end;         // first sample after the loop
+	int32_t xstart;      // first sample of the crossfade region, end of it is the loop end
+	const double *data;  // sample data it was built from - the renderer ignores it for any other sample
+	float xf[2][LOOP_XFADE];  // crossfaded audio for the last part of the loop
+};
+
+struct loopinfo {
+	loopbank bank[2];
+	std::atomic<int8_t> cur;  // bank the renderer uses, -1 if the slot has no loop
+	int32_t wantstart;   // what the current bank was built for - loader only
+	int32_t wantend;
+	const double *wantdata;
+	int32_t start;       // renderer's copy of the current bank for this block
+	int32_t end;
+	int32_t xstart;
+	const float (*xf)[LOOP_XFADE];
+	double plen;         // loop length as a fraction of the sample - for the phasor
+	bool valid;          // slot has a loop
+	bool active;         // looping on this block
+} loops[NUMSAMPLES];
+
+float loopfade[LOOP_XFADE];  // equal power fade in, fade out is read backwards
+
+void loops_init(void) {
+	for (int i=0;i<LOOP_XFADE;++i) loopfade[i]=sinf((i+0.5f)/LOOP_XFADE*M_PI/2);
+	for (int s=0;s<NUMSAMPLES;++s) {
+		loops[s].cur=-1;
+		loops[s].wantdata=NULL;
+	}
+}
+
+// work out the loop points for a slot and rebuild the crossfade if they changed - kit loader thread or before the audio starts
+// the loader is the only thing that swaps samples so the sample can't change under us
+void loop_build(int s) {
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	int32_t start,end;
+	loopinfo *l=&loops[s];
+
+	if (samp[s].loopend > samp[s].loopstart) {  // menu loop points are 0-1000 of the sample length
+		start=(int32_t)((int64_t)samp[s].loopstart*size/1000);
+		end=(int32_t)((int64_t)samp[s].loopend*size/1000);
+	}
+	else {
+		start=audioFile[s].loopStart;
+		end=audioFile[s].loopEnd;
+	}
+	const double *data=(size > 0) ? audioFile[s].samples[0].data() : NULL;
+	if ((start == l->wantstart) && (end == l->wantend) && (data == l->wantdata)) return;  // no change
+
+	l->wantstart=start;
+	l->wantend=end;
+	l->wantdata=data;
+	if ((data == NULL) || (start < 0) || (end <= start+1) || (end > size)) {
+		l->cur=-1;
+		return;
+	}
+	int b=(l->cur == 0) ? 1 : 0;  // the one the renderer isn't using
+	loopbank *k=&l->bank[b];
+	int32_t len=LOOP_XFADE;  // crossfade can't reach back past the start of the sample or be more than half the loop
+	if (len > start) len=start;
+	if (len > (end-start)/2) len=(end-start)/2;
+	k->start=start;
+	k->end=end;
+	k->xstart=end-len;
+	k->data=data;
+	for (int ch=0;ch<2;++ch) {  // same channels the renderer uses - first and last
+		const double *src=audioFile[s].samples[ch ? audioFile[s].getNumChannels()-1 : 0].data();
+		for (int32_t i=0;i<len;++i) {
+			float in=loopfade[(int64_t)i*LOOP_XFADE/len];
+			float out=loopfade[LOOP_XFADE-1-(int64_t)i*LOOP_XFADE/len];
+			k->xf[ch][i]=src[k->xstart+i]*out+src[start-len+i]*in;  // ends up as the samples just before the loop start
+		}
+	}
+	l->cur=b;
+}
+
+void loops_build(void) {
+	for (int s=0;s<NUMSAMPLES;++s) loop_build(s);
+}
+
+// pick up the current loop for a slot - called once per block from the renderer
+void loop_update(int s) {
+	loopinfo *l=&loops[s];
+	int8_t b=l->cur;
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	const double *data=(size > 0) ? audioFile[s].samples[0].data() : NULL;
+	l->valid=(b >= 0) && (l->bank[b].data == data);  // not built for a sample that was just swapped in
+	if (!l->valid) return;
+	const loopbank *k=&l->bank[b];
+	l->start=k->start;
+	l->end=k->end;
+	l->xstart=k->xstart;
+	l->xf=k->xf;
+	l->plen=(double)(k->end-k->start)/size;
+}
+
+// index of the sample after i in the direction we're playing, for the interpolator
+// round the loop if we're sustaining, otherwise round the sample
+inline int32_t loopnext(int s, int32_t i, int32_t samplesize) {
+	loopinfo *l=&loops[s];
+	if (samp[s].phaseinc < 0) {
+		if (l->active && (i == l->start)) return l->end-1;
+		return (i > 0) ? i-1 : samplesize-1;
+	}
+	if (l->active && (i+1 == l->end)) return l->start;
+	return (i+1 < samplesize) ? i+1 : 0;
+}
+
+// fetch a sample from channel ch, using the crossfade region if we are looping
+inline double loopfetch(int s, int ch, int32_t i) {
+	loopinfo *l=&loops[s];
+	if (l->active && (i >= l->xstart) && (i < l->end)) return l->xf[ch ? 1 : 0][i-l->xstart];
+	return audioFile[s].samples[ch][i];
+}
+
+// state to go to when a gate or note ends - a looped sound plays out its tail
+int16_t releasestate(int s) {
+	if (loops[s].active) return RELEASING;
+	return SILENT;
+}
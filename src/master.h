@@ -0,0 +1,283 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// master dynamics on the summed output
+// the stream is opened with paClipOff so anything over +-1.0 hard clips in the DAC - eight slots at full level easily get there
+// there's an optional peak limiter with a short lookahead, then a soft clipper that never lets anything past +-1.0
+// the limiter holds the smallest gain needed over the lookahead window, lets it recover at the release rate and
+// smooths it with a moving average the length of the window - that way the gain is already down when a peak comes out
+// of the lookahead delay, so it never overshoots. turning it on adds LIM_LOOKAHEAD samples of latency
+// the soft clipper leaves everything under CLIP_KNEE alone and bends the rest with a rational tanh that reaches 1.0 exactly at 2.0 in
+// with NEON it does four samples at a time and counts how many came in over 1.0 while it's at it
+// for integer output the clipper is the last pass over the block - it dithers, rounds and writes the device's format
+// straight into its buffer so there's no separate conversion pass afterwards
+
+#define LIM_LOOKAHEAD 32  // samples - 0.7ms
+#define CLIP_KNEE 0.5f    // soft clipper starts bending here
+
+int16_t masterclip=1;        // soft clipper on
+int16_t masterlimit=0;       // limiter on
+int16_t limceiling=900;      // limiter ceiling 0-1000
+int16_t limrelease=100;      // limiter release in ms
+std::atomic<uint32_t> masterclips(0);  // samples that were over full scale going into the clipper - for the status menu
+int16_t masterdither=1;      // TPDF dither on 16 and 24 bit output
+bool clipvector=1;           // NEON clip paths in use - softclip_check() turns them off if they don't match the scalar ones
+uint32_t ditherseed[4]={0x9E3779B9,0x7F4A7C15,0x6A09E667,0xBB67AE85};  // xorshift32 state, one per NEON lane - never 0
+
+struct limiterstate {
+	float delay[LIM_LOOKAHEAD][OUT_MAXCHANNELS];  // lookahead delay line
+	float need[LIM_LOOKAHEAD+1];    // gain each sample in the window needs - one more than the delay so the sample
+	                                // coming out is still in it
+	float avg[LIM_LOOKAHEAD];       // held gains being averaged
+	double sum;                     // sum of avg[]
+	float hold;                     // held gain after release
+	int pos;
+	int needpos;
+	bool on;
+} limiter;
+
+// start from unity gain with an empty delay
+void limiter_reset(void) {
+	memset(limiter.delay,0,sizeof(limiter.delay));
+	for (int i=0;i<LIM_LOOKAHEAD;++i) limiter.avg[i]=1.0f;
+	for (int i=0;i<=LIM_LOOKAHEAD;++i) limiter.need[i]=1.0f;
+	limiter.sum=LIM_LOOKAHEAD;
+	limiter.hold=1.0f;
+	limiter.pos=0;
+	limiter.needpos=0;
+}
+
+// lookahead peak limiter on the interleaved output, in place - all the channels get the same gain
+void limiter_process(float *out, unsigned long frames) {
+	float ceiling=(float)limceiling/1000;
+	if (ceiling < 0.1f) ceiling=0.1f;
+	float rel=1.0f-expf(-1.0f/((float)limrelease*SAMPLE_RATE/1000));
+	for (unsigned long i=0;i<frames;++i) {
+		float *frame=&out[i*outchannels];
+		float peak=0;
+		for (int c=0;c<outchannels;++c) peak=std::max(peak,fabsf(frame[c]));
+		int p=limiter.pos;
+		limiter.need[limiter.needpos]=(peak > ceiling) ? ceiling/peak : 1.0f;
+		limiter.needpos=(limiter.needpos+1)%(LIM_LOOKAHEAD+1);
+		float g=limiter.need[0];
+		for (int k=1;k<=LIM_LOOKAHEAD;++k) g=std::min(g,limiter.need[k]);  // smallest gain from the sample going out to this one
+		if (g < limiter.hold) limiter.hold=g;  // down right away
+		else limiter.hold+=(g-limiter.hold)*rel;  // back up at the release rate
+		limiter.sum+=limiter.hold-limiter.avg[p];
+		limiter.avg[p]=limiter.hold;
+		float gain=(float)(limiter.sum*(1.0/LIM_LOOKAHEAD));
+		for (int c=0;c<outchannels;++c) {
+			float x=frame[c];
+			frame[c]=limiter.delay[p][c]*gain;  // oldest sample in the delay
+			limiter.delay[p][c]=x;
+		}
+		limiter.pos=(p+1)%LIM_LOOKAHEAD;
+	}
+}
+
+#ifdef __ARM_NEON
+// soft clip four samples - straight through up to CLIP_KNEE, then a rational tanh scaled to fit between the knee and 1.0
+static inline float32x4_t softclip4(float32x4_t v) {
+	const float32x4_t one=vdupq_n_f32(1.0f);
+	const float32x4_t knee=vdupq_n_f32(CLIP_KNEE);
+	const float32x4_t c27=vdupq_n_f32(27.0f);
+	float32x4_t a=vabsq_f32(v);
+	float32x4_t u=vminq_f32(vmulq_f32(vsubq_f32(a,knee),vdupq_n_f32(1.0f/(1.0f-CLIP_KNEE))),vdupq_n_f32(3.0f));
+	float32x4_t u2=vmulq_f32(u,u);
+	float32x4_t num=vmulq_f32(u,vaddq_f32(c27,u2));
+	float32x4_t den=vmlaq_f32(c27,vdupq_n_f32(9.0f),u2);
+	float32x4_t inv=vrecpeq_f32(den);  // estimate and two Newton steps is close enough for audio
+	inv=vmulq_f32(inv,vrecpsq_f32(den,inv));
+	inv=vmulq_f32(inv,vrecpsq_f32(den,inv));
+	float32x4_t y=vmlaq_f32(knee,vmulq_f32(num,inv),vsubq_f32(one,knee));
+	y=vbslq_f32(vcleq_f32(a,knee),a,y);  // under the knee goes straight through
+	return vbslq_f32(vdupq_n_u32(0x80000000),v,y);  // put the sign back
+}
+#endif
+
+// soft clip one sample - same curve as softclip4()
+static inline float softclip1(float x) {
+	float a=fabsf(x);
+	if (a <= CLIP_KNEE) return x;
+	float u=(a-CLIP_KNEE)/(1.0f-CLIP_KNEE);
+	if (u > 3.0f) u=3.0f;
+	float u2=u*u;
+	float y=CLIP_KNEE+(1.0f-CLIP_KNEE)*u*(27.0f+u2)/(27.0f+9.0f*u2);
+	return copysignf(y,x);
+}
+
+// soft clip n samples in place, returns the number that were over full scale
+uint32_t softclip(float *x, unsigned long n) {
+	uint32_t over=0;
+	unsigned long i=0;
+#ifdef __ARM_NEON
+	float32x4_t one=vdupq_n_f32(1.0f);
+	uint32x4_t count=vdupq_n_u32(0);
+	for (;clipvector && i+4<=n;i+=4) {
+		float32x4_t v=vld1q_f32(&x[i]);
+		count=vsubq_u32(count,vcgtq_f32(vabsq_f32(v),one));  // compare gives all ones ie -1 for each one over
+		vst1q_f32(&x[i],softclip4(v));
+	}
+	over=vgetq_lane_u32(count,0)+vgetq_lane_u32(count,1)+vgetq_lane_u32(count,2)+vgetq_lane_u32(count,3);
+#endif
+	for (;i<n;++i) {
+		if (fabsf(x[i]) > 1.0f) ++over;
+		x[i]=softclip1(x[i]);
+	}
+	return over;
+}
+
+// count samples over full scale without changing them - for when the clipper is off
+uint32_t countclips(const float *x, unsigned long n) {
+	uint32_t over=0;
+	for (unsigned long i=0;i<n;++i) over+=(fabsf(x[i]) > 1.0f);
+	return over;
+}
+
+// next TPDF dither value in LSBs - the difference of the two 16 bit halves of a xorshift32 word is triangular over +-1
+static inline float dither1(void) {
+	uint32_t s=ditherseed[0];
+	s^=s<<13;
+	s^=s>>17;
+	s^=s<<5;
+	ditherseed[0]=s;
+	return (float)((int32_t)(s & 0xffff)-(int32_t)(s>>16))*(1.0f/65536);
+}
+
+// last pass for integer output - clip, dither, round and store n samples of x straight into the device's format
+// one of these for each format so the loop has no format tests in it. returns the number of samples over full scale
+// 24 bit goes in the top of a 32 bit word, which is what I2S codecs take. 32 bit isn't dithered - a float doesn't have
+// the resolution for its LSB to mean anything
+template <int FMT>
+uint32_t master_quantize(const float *x, void *dest, unsigned long n) {
+	const float scale=(FMT == OUTS16) ? 32767.0f : (FMT == OUTS24) ? 8388607.0f : 2147483520.0f;  // biggest float under 2^31
+	const int32_t top=(FMT == OUTS16) ? 32767 : (FMT == OUTS24) ? 8388607 : INT32_MAX;
+	bool dither=masterdither && (FMT != OUTS32);
+	bool clip=masterclip;
+	int16_t *d16=(int16_t *)dest;
+	int32_t *d32=(int32_t *)dest;
+	uint32_t over=0;
+	unsigned long i=0;
+#ifdef __ARM_NEON
+	float32x4_t one=vdupq_n_f32(1.0f);
+	float32x4_t minusone=vdupq_n_f32(-1.0f);
+	float32x4_t vscale=vdupq_n_f32(scale);
+	float32x4_t half=vdupq_n_f32(0.5f);
+	float32x4_t lsb=vdupq_n_f32(1.0f/65536);
+	uint32x4_t sign=vdupq_n_u32(0x80000000);
+	uint32x4_t low=vdupq_n_u32(0xffff);
+	uint32x4_t count=vdupq_n_u32(0);
+	uint32x4_t seed=vld1q_u32(ditherseed);
+	int32x4_t vtop=vdupq_n_s32(top);
+	int32x4_t vbottom=vdupq_n_s32(-top-1);
+	for (;clipvector && i+4<=n;i+=4) {
+		float32x4_t v=vld1q_f32(&x[i]);
+		count=vsubq_u32(count,vcgtq_f32(vabsq_f32(v),one));
+		v=clip ? softclip4(v) : vminq_f32(vmaxq_f32(v,minusone),one);
+		v=vmulq_f32(v,vscale);
+		if (dither) {  // four xorshift32 generators side by side
+			seed=veorq_u32(seed,vshlq_n_u32(seed,13));
+			seed=veorq_u32(seed,vshrq_n_u32(seed,17));
+			seed=veorq_u32(seed,vshlq_n_u32(seed,5));
+			int32x4_t tri=vsubq_s32(vreinterpretq_s32_u32(vandq_u32(seed,low)),vreinterpretq_s32_u32(vshrq_n_u32(seed,16)));
+			v=vmlaq_f32(v,vcvtq_f32_s32(tri),lsb);
+		}
+		int32x4_t q=vcvtq_s32_f32(vaddq_f32(v,vbslq_f32(sign,v,half)));  // convert truncates so add half away from 0 - it saturates too
+		if (FMT == OUTS16) vst1_s16(&d16[i],vqmovn_s32(q));
+		else if (FMT == OUTS24) vst1q_s32(&d32[i],vshlq_n_s32(vminq_s32(vmaxq_s32(q,vbottom),vtop),8));
+		else vst1q_s32(&d32[i],q);
+	}
+	vst1q_u32(ditherseed,seed);
+	over=vgetq_lane_u32(count,0)+vgetq_lane_u32(count,1)+vgetq_lane_u32(count,2)+vgetq_lane_u32(count,3);
+#endif
+	for (;i<n;++i) {
+		float v=x[i];
+		if (fabsf(v) > 1.0f) ++over;
+		v=clip ? softclip1(v) : std::min(std::max(v,-1.0f),1.0f);
+		v*=scale;
+		if (dither) v+=dither1();
+		int64_t q=std::min(std::max((int64_t)llrintf(v),(int64_t)-top-1),(int64_t)top);
+		if (FMT == OUTS16) d16[i]=(int16_t)q;
+		else if (FMT == OUTS24) d32[i]=(int32_t)(q*256);
+		else d32[i]=(int32_t)q;
+	}
+	return over;
+}
+
+// make sure the four at a time clippers agree with the one at a time ones - a ramp from -2 to 2 through the float
+// clipper and each integer format, against softclip1(). called once at startup - if they're out it says so and falls
+// back to the scalar code rather than distort every block
+bool softclip_check(void) {
+	const int n=1001;  // not a multiple of 4 so the scalar tail gets some too
+	float x[n],y[n];
+	int16_t d16[n];
+	int32_t d32[n];
+	float worst=0;
+	int16_t olddither=masterdither,oldclip=masterclip;
+	masterdither=0;  // so the integer output is exactly the rounded curve
+	masterclip=1;
+	for (int i=0;i<n;++i) y[i]=x[i]=-2.0f+4.0f*i/(n-1);
+	softclip(y,n);
+	for (int i=0;i<n;++i) worst=std::max(worst,fabsf(y[i]-softclip1(x[i])));
+	master_quantize<OUTS16>(x,d16,n);
+	for (int i=0;i<n;++i) worst=std::max(worst,fabsf(d16[i]/32767.0f-softclip1(x[i])));
+	master_quantize<OUTS24>(x,d32,n);
+	for (int i=0;i<n;++i) worst=std::max(worst,fabsf((d32[i]>>8)/8388607.0f-softclip1(x[i])));
+	master_quantize<OUTS32>(x,d32,n);
+	for (int i=0;i<n;++i) worst=std::max(worst,fabsf(d32[i]/2147483520.0f-softclip1(x[i])));
+	masterdither=olddither;
+	masterclip=oldclip;
+	if (worst > 1e-4f) {
+		printf("soft clipper is out by %f - using the scalar code\n",worst);
+		clipvector=0;
+		return 0;
+	}
+	return 1;
+}
+
+// master dynamics on a rendered block of interleaved output - renderer only
+// mix is the float mix, out is where the device wants the block - the same buffer for float output
+void master_process(float *mix, void *out, unsigned long frames) {
+	if (masterlimit) {
+		if (!limiter.on) limiter_reset();
+		limiter_process(mix,frames);
+	}
+	limiter.on=masterlimit;
+	uint32_t over;
+	unsigned long n=frames*outchannels;
+	switch (outformat) {
+		case OUTS16: over=master_quantize<OUTS16>(mix,out,n); break;
+		case OUTS24: over=master_quantize<OUTS24>(mix,out,n); break;
+		case OUTS32: over=master_quantize<OUTS32>(mix,out,n); break;
+		default:  // float - clip in place
+			if (masterclip) over=softclip(mix,n);
+			else over=countclips(mix,n);
+			break;
+	}
+	if (over) masterclips.fetch_add(over,std::memory_order_relaxed);
+}
@@ -53,31 +53,32 @@
 #define SUBMENU_X (1 * DISPLAY_CHAR_WIDTH)   // x pos to display sub menus name field
 #define SUBMENU_VALUE_X (14 * DISPLAY_CHAR_WIDTH)  // x pos to display submenu values
 #define SUBMENU_LINES 5 // number of menu text lines to display
-#define FILEMENU_LINES 5 // number of files to show 
+#define STATUS_REFRESH 50 // menu passes between status value updates - about half a second
+#define FILEMENU_LINES FB_PAGELINES // number of files to show - the browser works a page at a time
 #define FILEMENU_X (1 * DISPLAY_CHAR_WIDTH)   // x pos to display file menus - first character reserved for selector character
 #define FILEMENU_Y (TOPMENU_LINE*(DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD))   // pixel y position to display file menus
 
 char *menutitle;  // points to title of current menu/submenu
 char *maintitle="   Sampleplayer   ";
 
-char *filesroot="./samples";  // root of file tree
-
-char directory[80]={""}; // current working directory
-
 int8_t topmenuindex=0;  // keeps track of which top menu item we are displaying
 //int8_t fileindex=0;  // keeps track of which file we are displaying
-int numfiles=0; // number of files in current directory
 
-enum paramtype{TYPE_NONE,TYPE_INTEGER,TYPE_FLOAT, TYPE_TEXT,TYPE_FILENAME}; // parameter display types
+enum paramtype{TYPE_NONE,TYPE_INTEGER,TYPE_FLOAT, TYPE_TEXT,TYPE_FILENAME,TYPE_ACTION,TYPE_STATUS}; // parameter display types
+// TYPE_ACTION items have no value - clicking on one calls the handler
+// TYPE_STATUS items show a value that can't be edited - they are refreshed while they are on screen
 
-// Instantiate the display
-ArduiPi_OLED display;
+// hand whatever changed to the display thread
+// drawing functions only change the framebuffer - this is called once per pass through the menus
+void oledupdate(void) {
+	display.display();
+}
 
-// holds file and directory info
-struct fileinfo {
-	char name[80];
-	bool isdir;   // true if directory
-} files[400];
+// show what we have drawn then wait till the encoder button is released
+void waitbuttonup(void) {
+	oledupdate();
+	while( button) usleep(100000);
+}
 
 
 	
@@ -114,11 +115,6 @@ void testfunc(void) {
   printf("test function %d\n",dummy);
 }; // 
 
-// for sorting filenames in alpha order
-int comp(const void *a,const void *b) {
-return (strcmp((char *)a,(char *)b));
-}
- 
 // ********** menu structs that build the menu system below *********
 
 
@@ -127,6 +123,19 @@ char * textmode[] = {"Trig", "Loop", "Gated"};
 char * textmidimode[] = {"Off    ", "Percuss", "Notes  "};
 char * modtarget[] = {"Nothing","  Level", "    Pan","  Speed","  Pitch"};
 char * CVchannel[] = {"None","   1", "   2","   3","   4","   5","   6","   7","   8"};
+char * textfastmode[] = {"   FM", "Scrub"};
+char * textscale[] = {"  Off", "Chrom", "Major", "Minor", "Custm"};
+char * textsort[] = {"  Name", "Length"};
+char * textoffon[] = {"Off", " On"};
+char * textslice[] = {" Off", "Step", "Note", "  CV"};
+char * textvoice[] = {"Sample", "Strtch", "Grains"};
+char * textfilter[] = {" Off", "  LP", "  HP", "  BP"};
+char * textoutput[] = {"1-2", "3-4", "5-6", "7-8"};
+
+// loop points were edited - the kit loader rebuilds the crossfade
+void loopedit(void) {
+	loop_request();
+}
 
 struct submenu sample0params[] = {
   // name,min,max,step,type,*textfield,*parameter,*handler
@@ -143,6 +152,33 @@ struct submenu sample0params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[0].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[0].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[0].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[0].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[0].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[0].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[0].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[0].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[0].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[0].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[0].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[0].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[0].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[0].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[0].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[0].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[0].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[0].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[0].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[0].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -161,6 +197,33 @@ struct submenu sample1params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[1].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[1].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[1].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[1].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[1].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[1].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[1].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[1].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[1].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[1].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[1].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[1].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[1].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[1].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[1].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[1].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[1].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[1].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[1].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[1].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -179,6 +242,33 @@ struct submenu sample2params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[2].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[2].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[2].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[2].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[2].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[2].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[2].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[2].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[2].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[2].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[2].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[2].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[2].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[2].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[2].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[2].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[2].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[2].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[2].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[2].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 struct submenu sample3params[] = {
@@ -196,6 +286,33 @@ struct submenu sample3params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[3].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[3].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[3].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[3].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[3].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[3].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[3].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[3].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[3].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[3].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[3].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[3].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[3].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[3].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[3].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[3].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[3].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[3].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[3].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[3].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -214,6 +331,33 @@ struct submenu sample4params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[4].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[4].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[4].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[4].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[4].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[4].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[4].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[4].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[4].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[4].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[4].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[4].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[4].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[4].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[4].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[4].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[4].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[4].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[4].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[4].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -232,6 +376,33 @@ struct submenu sample5params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[5].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[5].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[5].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[5].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[5].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[5].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[5].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[5].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[5].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[5].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[5].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[5].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[5].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[5].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[5].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[5].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[5].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[5].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[5].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[5].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -250,6 +421,33 @@ struct submenu sample6params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[6].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[6].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[6].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[6].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[6].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[6].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[6].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[6].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[6].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[6].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[6].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[6].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[6].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[6].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[6].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[6].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[6].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[6].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[6].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[6].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -268,6 +466,33 @@ struct submenu sample7params[] = {
   "Pan CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].panCV,0, 
   "Speed CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].speedCV,0, 
   "Pitch CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].pitchCV,resetCVpitch, 
+  "Fast CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].fastCV,0, 
+  "Fast CV Mode",0,1,1,TYPE_TEXT,textfastmode,&samp[7].fastmode,0, 
+  "FM Depth",0,1000,10,TYPE_FLOAT,0,&samp[7].fmdepth,0,
+  "Pitch Quant",0,4,1,TYPE_TEXT,textscale,&samp[7].quantize,0, 
+  "Start",0,990,10,TYPE_FLOAT,0,&samp[7].start,0,
+  "Sync Beats",0,64,1,TYPE_INTEGER,0,&samp[7].syncbeats,0,
+  "Loop Start",0,1000,1,TYPE_FLOAT,0,&samp[7].loopstart,loopedit,
+  "Loop End",0,1000,1,TYPE_FLOAT,0,&samp[7].loopend,loopedit,
+  "Slice",0,3,1,TYPE_TEXT,textslice,&samp[7].slicemode,0,
+  "Slice CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].sliceCV,0,
+  "Voice",0,2,1,TYPE_TEXT,textvoice,&samp[7].voice,0,
+  "Grain Pos",0,1000,10,TYPE_FLOAT,0,&samp[7].grainpos,0,
+  "Grain Pos CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].grainposCV,0,
+  "Density",1,GRAIN_MAXDENSITY,1,TYPE_INTEGER,0,&samp[7].density,0,
+  "Density CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].densityCV,0,
+  "Grain Size",GRAIN_MINSIZE,GRAIN_MAXSIZE,5,TYPE_INTEGER,0,&samp[7].grainsize,0,
+  "Grain Size CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].grainsizeCV,0,
+  "Spray",0,GRAIN_MAXSPRAY,5,TYPE_INTEGER,0,&samp[7].spray,0,
+  "Spray CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].sprayCV,0,
+  "Filter",0,3,1,TYPE_TEXT,textfilter,&samp[7].filter,0,
+  "Cutoff",0,1000,10,TYPE_FLOAT,0,&samp[7].cutoff,0,
+  "Cutoff CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].cutoffCV,0,
+  "Resonance",0,1000,10,TYPE_FLOAT,0,&samp[7].resonance,0,
+  "Res CV",0,8,1,TYPE_TEXT,CVchannel,&samp[7].resonanceCV,0,
+  "Delay Send",0,1000,10,TYPE_FLOAT,0,&samp[7].delaysend,0,
+  "Reverb Send",0,1000,10,TYPE_FLOAT,0,&samp[7].reverbsend,0,
+  "Output",0,OUT_MAXCHANNELS/2-1,1,TYPE_TEXT,textoutput,&samp[7].output,0,
   "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
 };
 
@@ -288,6 +513,216 @@ struct submenu osc2params[] = {
 };
 */
 
+// setup menu - CV calibration and global settings
+
+int16_t calchannel=1;  // CV channel being calibrated 1-8
+int16_t cal1v,cal3v;   // its calibration readings
+
+// load the readings for the channel we are calibrating
+void calselect(void) {
+	cal1v=cvcal[calchannel-1].code1v;
+	cal3v=cvcal[calchannel-1].code3v;
+}
+
+// readings were edited - apply them
+void caledit(void) {
+	cvcal[calchannel-1].code1v=cal1v;
+	cvcal[calchannel-1].code3v=cal3v;
+	cvcal_update(calchannel-1);
+}
+
+void calread1v(void) {  // patch 1.000V into the channel then click
+	cal1v=cvcal_measure(calchannel-1);
+	caledit();
+}
+
+void calread3v(void) {  // patch 3.000V into the channel then click
+	cal3v=cvcal_measure(calchannel-1);
+	caledit();
+}
+
+void calsave(void) {
+	cvcal_save();
+}
+
+void scalemaskedit(void) {
+	quant_init();
+}
+
+struct submenu setupparams[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Cal Channel",1,8,1,TYPE_INTEGER,0,&calchannel,calselect,
+  "Read 1V",0,0,1,TYPE_ACTION,0,&dummy,calread1v,
+  "1V Reading",0,8190,1,TYPE_INTEGER,0,&cal1v,caledit,
+  "Read 3V",0,0,1,TYPE_ACTION,0,&dummy,calread3v,
+  "3V Reading",0,8190,1,TYPE_INTEGER,0,&cal3v,caledit,
+  "Save Cal",0,0,1,TYPE_ACTION,0,&dummy,calsave,
+  "Scale Mask",0,4095,1,TYPE_INTEGER,0,&scalemask,scalemaskedit,  // custom scale - bit 0 = C .. bit 11 = B
+  "File Sort",0,1,1,TYPE_TEXT,textsort,&filesort,0,
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
+// kits menu - save and load all the sample slots
+
+int16_t kitnumber=1;  // kit to load or save
+
+void kitload(void) {
+	kit_request(kitnumber);  // loads in the background - old kit plays till its ready
+}
+
+void kitsave(void) {
+	kit_write(kitnumber);
+}
+
+void kitprefetchedit(void) {
+	kit_wake();  // loader fills or frees the cache
+}
+
+struct submenu kitmenu[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Kit",1,KIT_MAX,1,TYPE_INTEGER,0,&kitnumber,0,
+  "Load Kit",0,0,1,TYPE_ACTION,0,&dummy,kitload,
+  "Save Kit",0,0,1,TYPE_ACTION,0,&dummy,kitsave,
+  "PC MIDI Ch",0,16,1,TYPE_INTEGER,0,&kitchannel,0,  // program change channel, 0=off
+  "Prefetch",0,1,1,TYPE_TEXT,textoffon,&kitprefetch,kitprefetchedit,
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
+// MIDI map menu - the route being edited is copied to these and back
+
+char * textsource[] = {"   CC", "PolyAT", "ChanAT", " Bend"};
+char * textmaptarget[] = {"Level", "  Pan", "Speed", "Pitch", "Start", "Cutoff", "  Res"};
+char * textcurve[] = {"Lin", "Exp", "Log"};
+
+int16_t maproute=1;  // route being edited 1-MIDIMAP_ROUTES
+midiroute mapedit={0,SRC_CC,1,1,MAP_LEVEL,0,1000,CURVE_LIN};
+
+// load the route we are editing
+void mapselect(void) {
+	mapedit=midiroutes[maproute-1];
+}
+
+// route was edited - write it back
+void mapchange(void) {
+	midiroutes[maproute-1]=mapedit;
+}
+
+#define MAPLEARN_TICKS 500  // menu passes before MIDI learn gives up - about 5 seconds
+
+// make the route follow the next controller that moves - domenus() waits for it in MIDILEARN so the UI and CVs keep running
+void maplearnaction(void) {
+	maplearn=maproute-1;
+}
+
+struct submenu midimapparams[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Route",1,MIDIMAP_ROUTES,1,TYPE_INTEGER,0,&maproute,mapselect,
+  "Learn",0,0,1,TYPE_ACTION,0,&dummy,maplearnaction,
+  "Source",0,3,1,TYPE_TEXT,textsource,&mapedit.source,mapchange,
+  "MIDI Ch",1,16,1,TYPE_INTEGER,0,&mapedit.channel,mapchange,
+  "CC/Note #",0,127,1,TYPE_INTEGER,0,&mapedit.number,mapchange,
+  "Slot",0,NUMSAMPLES,1,TYPE_INTEGER,0,&mapedit.slot,mapchange,  // 0 turns the route off
+  "Target",0,MAP_TARGETS-1,1,TYPE_TEXT,textmaptarget,&mapedit.target,mapchange,
+  "Min",-1000,1000,10,TYPE_FLOAT,0,&mapedit.min,mapchange,
+  "Max",-1000,1000,10,TYPE_FLOAT,0,&mapedit.max,mapchange,
+  "Curve",0,2,1,TYPE_TEXT,textcurve,&mapedit.curve,mapchange,
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
+// effects menu - send effects on the mix
+
+char * textreverb[] = {"  FDN", "   IR"};
+
+struct submenu fxparams[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Delay Time",10,FX_MAXDELAY,5,TYPE_INTEGER,0,&fxdelaytime,0,  // ms
+  "Delay Fdbk",0,950,10,TYPE_FLOAT,0,&fxdelayfb,0,
+  "Delay Damp",0,1000,10,TYPE_FLOAT,0,&fxdelaydamp,0,
+  "Delay Level",0,1000,10,TYPE_FLOAT,0,&fxdelaylevel,0,
+  "Reverb Time",100,9900,100,TYPE_INTEGER,0,&fxreverbtime,0,  // ms
+  "Reverb Damp",0,1000,10,TYPE_FLOAT,0,&fxreverbdamp,0,
+  "Reverb Level",0,1000,10,TYPE_FLOAT,0,&fxreverblevel,0,
+  "Reverb Type",0,1,1,TYPE_TEXT,textreverb,&fxreverbtype,0,
+  "",NUMSAMPLES,0,1,TYPE_FILENAME,0,&dummy,0,  // IR file - min past the last slot means the reverb IR
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
+// master menu - dynamics on the output
+
+struct submenu masterparams[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Soft Clip",0,1,1,TYPE_TEXT,textoffon,&masterclip,0,
+  "Limiter",0,1,1,TYPE_TEXT,textoffon,&masterlimit,0,
+  "Lim Ceiling",100,1000,10,TYPE_FLOAT,0,&limceiling,0,
+  "Lim Release",10,1000,10,TYPE_INTEGER,0,&limrelease,0,  // ms
+  "Dither",0,1,1,TYPE_TEXT,textoffon,&masterdither,0,  // 16 and 24 bit output
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
+// status menu - what the engine is doing. values are copied here by statusupdate() while the menu is showing
+
+int16_t statusvoices;  // stretch voices running
+int16_t statusus;      // worst recent block of any stretch voice in us
+int16_t statusload;    // worst recent blocks of all the stretch voices as a percent of the block time
+int16_t statusgrains;  // grains playing
+int16_t statusgrainload;  // granular voices as a percent of the block time
+int16_t statusfxload;  // effects thread as a percent of the block time
+int16_t statusfxunder; // blocks the effects were late for
+int16_t statusbpm;     // MIDI clock tempo, 0 if no clock
+int16_t statusirload;  // convolution thread as a percent of the time it has
+int16_t statusirlate;  // IR tail partitions that were too late to play
+int16_t statusclips;   // output samples over full scale
+int16_t statuslatency; // output buffer latency in us
+int16_t statusjitter;  // worst recent wakeup jitter of the audio thread in us
+int16_t statusperiod;  // frames per buffer
+int16_t statusperiods; // buffers
+int16_t statusxruns;   // output underruns
+int16_t statusaudioload;  // rendering as a percent of the buffer time
+
+void statusupdate(void) {
+	stretch_stats(&statusvoices,&statusus,&statusload);
+	statusgrains=grainsactive;
+	statusgrainload=(int16_t)grainload;
+	statusfxload=(int16_t)std::min(fxloadus*100/fxblockus,9999.0f);
+	statusfxunder=fxunderruns;
+	statusbpm=clockbpm;
+	statusirload=(int16_t)std::min(convloadus*100/convblockus,9999.0f);
+	statusirlate=convlate;
+	statusclips=(int16_t)std::min(masterclips.load(),(uint32_t)32767);
+	statuslatency=(int16_t)std::min(outlatencyus,32767.0f);
+	statusjitter=(int16_t)std::min(outjitterus,32767.0f);
+	statusperiod=latencysteps[latencystep].period;
+	statusperiods=latencysteps[latencystep].periods;
+	statusxruns=(int16_t)std::min(xruns.load(),(uint32_t)32767);
+	statusaudioload=(int16_t)std::min(audioload*100,9999.0f);
+}
+
+struct submenu statusparams[] = {
+  // name,min,max,step,type,*textfield,*parameter,*handler
+  "Strch Voices",0,0,1,TYPE_STATUS,0,&statusvoices,0,
+  "Strch Peak us",0,0,1,TYPE_STATUS,0,&statusus,0,
+  "Strch Load %",0,0,1,TYPE_STATUS,0,&statusload,0,
+  "Max Stretch",0,NUMSAMPLES,1,TYPE_INTEGER,0,&stretchmax,0,  // slots over this play without stretch
+  "Grains",0,0,1,TYPE_STATUS,0,&statusgrains,0,
+  "Grain Load %",0,0,1,TYPE_STATUS,0,&statusgrainload,0,
+  "FX Load %",0,0,1,TYPE_STATUS,0,&statusfxload,0,
+  "FX Late",0,0,1,TYPE_STATUS,0,&statusfxunder,0,
+  "IR Load %",0,0,1,TYPE_STATUS,0,&statusirload,0,
+  "IR Late",0,0,1,TYPE_STATUS,0,&statusirlate,0,
+  "Clips",0,0,1,TYPE_STATUS,0,&statusclips,0,
+  "Latency us",0,0,1,TYPE_STATUS,0,&statuslatency,0,
+  "Jitter us",0,0,1,TYPE_STATUS,0,&statusjitter,0,
+  "Auto Latency",0,1,1,TYPE_TEXT,textoffon,&latencyauto,0,
+  "Latency Step",0,LATENCY_STEPS-1,1,TYPE_INTEGER,0,&latencystep,0,  // main loop restarts the audio with it
+  "Period",0,0,1,TYPE_STATUS,0,&statusperiod,0,
+  "Periods",0,0,1,TYPE_STATUS,0,&statusperiods,0,
+  "Xruns",0,0,1,TYPE_STATUS,0,&statusxruns,0,
+  "Xrun Target",0,60,1,TYPE_INTEGER,0,&xruntarget,0,  // per minute
+  "Audio Load %",0,0,1,TYPE_STATUS,0,&statusaudioload,0,
+  "Clock BPM",0,0,1,TYPE_STATUS,0,&statusbpm,0,
+  "BACK",0,0,1,TYPE_NONE,0,&dummy,0,
+};
+
 // top level menu structure - each top level menu contains one submenu
 struct menu mainmenu[] = {
   // name,submenu *,initial submenu index,number of submenus
@@ -299,6 +734,12 @@ struct menu mainmenu[] = {
   "6 ",sample5params,0,sizeof(sample5params)/sizeof(submenu),
   "7 ",sample6params,0,sizeof(sample6params)/sizeof(submenu),
   "8 ",sample7params,0,sizeof(sample7params)/sizeof(submenu),
+  "Kits",kitmenu,0,sizeof(kitmenu)/sizeof(submenu),
+  "MIDI Map",midimapparams,0,sizeof(midimapparams)/sizeof(submenu),
+  "Setup",setupparams,0,sizeof(setupparams)/sizeof(submenu),
+  "Effects",fxparams,0,sizeof(fxparams)/sizeof(submenu),
+  "Master",masterparams,0,sizeof(masterparams)/sizeof(submenu),
+  "Status",statusparams,0,sizeof(statusparams)/sizeof(submenu),
   };
 
 #define NUM_MAIN_MENUS sizeof(mainmenu)/ sizeof(menu)
@@ -309,7 +750,6 @@ void drawselector( int8_t index) {
   int line = index % TOPMENU_LINES;
   display.setCursor (0, TOPMENU_Y+DISPLAY_Y_MENUPAD+line*(DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD) );
   display.print(">"); 
-  display.display();
 }
 
 // highlight the currently selected menu item as being edited
@@ -317,7 +757,6 @@ void draweditselector( int8_t index) {
   int line = index % TOPMENU_LINES;
   display.setCursor (0, TOPMENU_Y+DISPLAY_Y_MENUPAD+line*(DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD) );
   display.print("*"); 
-  display.display();
 }
 
 // dehighlight the currently selected menu item
@@ -325,7 +764,6 @@ void undrawselector( int8_t index) {
   int line = index % TOPMENU_LINES;
   display.setCursor (0, TOPMENU_Y+DISPLAY_Y_MENUPAD+line*(DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD) );
   display.print(" "); 
-  display.display();
 }
 
 // display the top menu
@@ -342,7 +780,7 @@ void drawtopmenu( int8_t index) {
     for (i; i< last ; ++i) {
       display.setCursor ( TOPMENU_X, y ); 
       display.print(topmenu[i].name);
-	  if (i < 8) {			// items 0-7 are always samples - show the sample filename
+	  if (i < NUMSAMPLES) {			// items 0-7 are always samples - show the sample filename
 		  char temp[DISPLAY_X];  // chop the name to no more than 18 chars
 		  strncpy(temp,samp[i].filename,DISPLAY_X-3); // 3 columns are used: selector, sample#, space
           temp[DISPLAY_X-3]=0; // null terminate
@@ -350,7 +788,6 @@ void drawtopmenu( int8_t index) {
 	  }
       y+=DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD;
     }
-    display.display();
 } 
 
 // display a sub menu item and its value
@@ -373,6 +810,7 @@ void drawsubmenu( int8_t index) {
       char temp[5];
       switch (sub[index].ptype) {
         case TYPE_INTEGER:   // print the value as an unsigned integer    
+        case TYPE_STATUS:
           sprintf(temp,"%4d",val); // lcd.print doesn't seem to print uint8 properly
           display.print(temp);  
           display.print(" ");  // blank out any garbage
@@ -387,11 +825,14 @@ void drawsubmenu( int8_t index) {
           if (val < 0) val=0; // min index is 0 for text fields
           display.print(sub[index].ptext[val]); // parameter value indexes into the string array
           display.print(" ");  // blank out any garbage
+          break;
+        case TYPE_ACTION:  // nothing to show
           break;
 		case TYPE_FILENAME:  // print filename of sample using index in min
 		  display.setCursor (SUBMENU_X, y ); // leave room for selector
 		  char temp[DISPLAY_X];  // chop the name to no more than 20 chars
-		  strncpy(temp,samp[sub[index].min].filename,DISPLAY_X-1); // hokey way of finding the sample's filename
+		  if (sub[index].min < NUMSAMPLES) strncpy(temp,samp[sub[index].min].filename,DISPLAY_X-1); // hokey way of finding the sample's filename
+		  else snprintf(temp,DISPLAY_X,"IR %s",irfilename[0] ? irfilename : "none");  // reverb IR
           strcat(temp,"");
 		  display.print(temp);  // 
           break;
@@ -401,7 +842,6 @@ void drawsubmenu( int8_t index) {
           break;
       } 
     }
-    display.display(); 
 }
 
 // display sub menus of the current topmenu
@@ -413,7 +853,8 @@ void drawsubmenus() {
     submenu * sub=topmenu[topmenuindex].submenus; //get pointer to the current submenu array
     display.clearDisplay();
     display.setCursor(0,0);
-    display.printf("     Sample %s",topmenu[topmenuindex].name); // show the menu we came from at top of screen
+    if (topmenuindex < NUMSAMPLES) display.printf("     Sample %s",topmenu[topmenuindex].name); // show the menu we came from at top of screen
+    else display.printf("     %s",topmenu[topmenuindex].name);
     int i = (index/SUBMENU_LINES)*SUBMENU_LINES; // which group of menu items to display
     int last = i+len % SUBMENU_LINES; // show only up to the last menu item
     if ((i + SUBMENU_LINES) <= len) last = i+SUBMENU_LINES; // handles case like 2nd of 3 menu pages
@@ -425,79 +866,62 @@ void drawsubmenus() {
       //y+=DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD;
       drawsubmenu(i);
     }
-    display.display();
 } 
 
-/* function to get the content of a given folder */
-
-int get_dir_content(char * path)
-{
-  DIR * d = opendir(path); // open the path
-  if(d==NULL) return 0; // if was not able, return
-  struct dirent * dir; // for the directory entries
-  int numfiles=0;
-  
-  while ((dir = readdir(d)) != NULL) // if we were able to read somehting from the directory
-    {
-      if(dir-> d_type != DT_DIR) {// if the type is not directory just print it with blue color
-		strcpy(files[numfiles].name,dir->d_name);
-		files[numfiles].isdir=0;
-		++ numfiles;
-	  }
-      else
-      if(dir -> d_type == DT_DIR && strcmp(dir->d_name,".")!=0 && strcmp(dir->d_name,"..")!=0 ) // if it is a directory
-      {
-	   strcpy(files[numfiles].name,dir->d_name);
-		files[numfiles].isdir=1;
-		++ numfiles;
-      }
-    }
-    closedir(d); // finally close the directory
-	qsort (files, numfiles, sizeof(fileinfo), comp);  // put them in alpha order
-	strcpy(files[numfiles].name,".."); // last entry is to go up
-	files[numfiles].isdir=0; // special case - don't treat it as a directory
-	++numfiles;
-	return numfiles;
-}
-
 // display a list of files
 // index - currently selected file
 void drawfilelist( int16_t index) {
 	char temp[DISPLAY_X+5];  // chop the name to no more than 20 chars
+	int len=strlen(browser.path);
     display.clearDisplay();
     display.setCursor(0,0);
-    display.printf("S%d /%s",topmenuindex,directory); // show sample # and current directory on top line
+    char who[4]="IR";  // sample # or the reverb IR
+    if (topmenuindex < NUMSAMPLES) snprintf(who,sizeof(who),"S%d",topmenuindex);
+    if (len > DISPLAY_X-4) display.printf("%s ..%s",who,browser.path+len-(DISPLAY_X-6)); // show the end of a long path
+    else display.printf("%s /%s",who,browser.path); // show sample # and current directory on top line
     int16_t i = (index/FILEMENU_LINES)*FILEMENU_LINES; // which group of menu items to display
-    int last = i+numfiles % TOPMENU_LINES; // show only up to the last menu item
-    if ((i + FILEMENU_LINES) <= numfiles) last = i+FILEMENU_LINES; // handles case like 2nd of 3 menu pages
+    int last = i+FILEMENU_LINES; // show only up to the last menu item
+    if (last > browser.count) last = browser.count; // last page may not be full
     int y=FILEMENU_Y+DISPLAY_Y_MENUPAD;
 
     for (i; i< last ; ++i) {
+      fileinfo *f=fb_entry(i);
+      int width=DISPLAY_X-1; // room left after the selector
       display.setCursor ( FILEMENU_X, y ); 
-	  if (files[i].isdir) display.print("/"); // show its a directory  		
-	  strncpy(temp,files[i].name,DISPLAY_X); // make sure it doesn't wrap to next line
-	  temp[DISPLAY_X]=0; // null terminate
+	  if (f->isdir) {
+		  display.print("/"); // show its a directory
+		  --width;
+	  }
+	  if (f->msec >= 0) width-=6;  // leave room for the length
+	  strncpy(temp,f->name,width); // make sure it doesn't wrap to next line
+	  temp[width]=0; // null terminate
       display.print(temp);
+	  if (f->msec >= 0) {  // show the length from the sample index at the right hand end
+		  char len[8];
+		  if (f->msec < 100000) snprintf(len,sizeof(len),"%5.1fs",f->msec/1000.0);
+		  else snprintf(len,sizeof(len),"%3d:%02d",f->msec/60000,(f->msec/1000)%60);
+		  display.setCursor ( FILEMENU_X+(DISPLAY_X-7)*DISPLAY_CHAR_WIDTH, y );
+		  display.print(len);
+	  }
       y+=DISPLAY_CHAR_HEIGHT+DISPLAY_Y_MENUPAD;
     }
-    display.display();
 } 
 
 // menu handler
 // a run to completion state machine - it never blocks except while waiting for encoder button release
 // allows the rest of the application to keep playing audio while parameters are adjusted
 
-enum uimodes{TOPSELECT,SUBSELECT,PARAM_INPUT,FILEBROWSER,WAITFORBUTTONUP}; // UI state machine states
+enum uimodes{TOPSELECT,SUBSELECT,PARAM_INPUT,FILEBROWSER,WAITFORBUTTONUP,MIDILEARN}; // UI state machine states
 
 
 void domenus(void) {
   int16_t enc;
   int8_t index; 
-  char temp[80]; // for file paths
+  char temp[PATHLEN]; // for file paths
   static int16_t fileindex=0;  // index of selected file/directory   
-  static int16_t lastdir=0;  // index of last directory we looked at
-  static int16_t lastfile=0;  // index of last file we looked at  
+  static int16_t lastfile=0;  // index of last file we looked at in the current directory
   static int16_t uistate=TOPSELECT; // start out at top menu
+  static int16_t learnticks=0;  // menu passes spent waiting for MIDI learn
   
   enc=encoder_getvalue();
 
@@ -524,7 +948,7 @@ void domenus(void) {
         drawsubmenus();
         drawselector(topmenu[topmenuindex].submenuindex);  
         uistate=SUBSELECT;
-        while( button) usleep(100000); // wait till button released
+        waitbuttonup(); // wait till button released
       }
       break;
     case SUBSELECT:  // scroll thru submenus
@@ -544,29 +968,51 @@ void domenus(void) {
             drawtopmenu(topmenuindex);
             drawselector(topmenuindex); 
             uistate=TOPSELECT;
-           while( button) usleep(100000); // wait till button released
+           waitbuttonup(); // wait till button released
         }
-		else if (topmenu[topmenuindex].submenuindex == 0) { // first submenu is always "file" so we go into file browser
-			char temp[80];
-			strcpy(temp,filesroot);
-			strcat(temp,"/");
-			strcat(temp,directory);
-			numfiles=get_dir_content(temp);
-			fileindex=0;
-            if (files[0].isdir) drawfilelist(fileindex=lastdir);
-			else drawfilelist(fileindex=lastfile);
+		else if (topmenu[topmenuindex].submenus[topmenu[topmenuindex].submenuindex].ptype == TYPE_STATUS) { // read only
+			waitbuttonup(); // wait till button released
+		}
+		else if (topmenu[topmenuindex].submenus[topmenu[topmenuindex].submenuindex].ptype == TYPE_ACTION) { // do it and stay here
+			index= topmenu[topmenuindex].submenuindex;
+			if (topmenu[topmenuindex].submenus[index].handler != 0) (*topmenu[topmenuindex].submenus[index].handler)();
+			drawsubmenus();  // action may have changed other values on the page
+			drawselector(index);
+			if (maplearn >= 0) {  // MIDI learn started
+				display.setCursor(0,0);
+				display.print(" Move a controller  ");
+				learnticks=0;
+				uistate=MIDILEARN;
+			}
+			waitbuttonup(); // wait till button released
+		}
+		else if (topmenu[topmenuindex].submenus[topmenu[topmenuindex].submenuindex].ptype == TYPE_FILENAME) { // sample file or reverb IR so we go into file browser
+			fb_open(browser.path);  // pick up any changes since last time
+			fileindex=lastfile;
+			if (fileindex >= browser.count) fileindex=0;
+            drawfilelist(fileindex);
             drawselector(fileindex); 
             uistate=FILEBROWSER;
-            while( button) usleep(100000); // wait till button released
+            waitbuttonup(); // wait till button released
         }
         else {
           undrawselector(topmenu[topmenuindex].submenuindex);
           draweditselector(topmenu[topmenuindex].submenuindex); // show we are editing
           uistate=PARAM_INPUT;  // change the submenu parameter
-          while( button) usleep(100000); // wait till button released
+          waitbuttonup(); // wait till button released
         }
       }   
       break;
+    case MIDILEARN:  // waiting for a controller to move - the MIDI thread clears maplearn when one does
+      if ((maplearn < 0) || button || (enc != 0) || (++learnticks >= MAPLEARN_TICKS)) {  // learned, cancelled or timed out
+        maplearn=-1;
+        mapselect();
+        drawsubmenus();
+        drawselector(topmenu[topmenuindex].submenuindex);
+        uistate=SUBSELECT;
+        if (button) waitbuttonup(); // wait till button released
+      }
+      break;
     case PARAM_INPUT:  // changing value of a parameter
       if (enc !=0 ) { // change value
         index= topmenu[topmenuindex].submenuindex; // submenu field index
@@ -582,41 +1028,36 @@ void domenus(void) {
         undrawselector(topmenu[topmenuindex].submenuindex);
         drawselector(topmenu[topmenuindex].submenuindex); // show we are selecting again
         uistate=SUBSELECT;
-        while( button) usleep(100000); // wait till button released
+        waitbuttonup(); // wait till button released
       }   
       break;
-	case FILEBROWSER:  // browse files - file structure is ./<filesroot>/<directory>/<file> ie all files must be in a directory and no more than 1 directory deep
+	case FILEBROWSER:  // browse files - file structure is ./<filesroot>/<directory>/.../<file>
       if (enc !=0 ) { // move selector
         int filespage = (fileindex) / TOPMENU_LINES;  
         undrawselector(fileindex);
         fileindex+=enc;
         if (fileindex <0) fileindex=0;  // we don't wrap menus around, just stop at the ends
-        if (fileindex >=(numfiles -1) ) fileindex=numfiles-1; 
+        if (fileindex >=(browser.count -1) ) fileindex=browser.count-1; 
         if ((fileindex / TOPMENU_LINES) != filespage) {
           drawfilelist(fileindex);  // redraw if we scrolled beyond the menu page
         }
         drawselector(fileindex);    
       }
       if (button) { // file item has been selected 
-		if (files[fileindex].isdir) {  // show nested directory	
-			lastdir=fileindex;    // remember where we were
-			strcpy(temp,filesroot);  // build new file path
-			strcat(temp,"/");
-			strcat(temp,files[fileindex].name);
-			strcpy(directory,files[fileindex].name); // save the current directory
-			numfiles=get_dir_content(temp);
-			fileindex=lastfile;
+		fileinfo *f=fb_entry(fileindex);
+		if (f->isdir) {  // show nested directory	
+			strcpy(temp,f->name);
+			fb_enter(temp,fileindex);  // remember where we were
+			fileindex=lastfile=0;  // new directory so start at beginning
             drawfilelist(fileindex);
             drawselector(fileindex);
-			while( button) usleep(100000); // wait till button released
+			waitbuttonup(); // wait till button released
 		}
-		else if (fileindex == (numfiles -1)) { // last file is always ".." so go up to directories
-			numfiles=get_dir_content(filesroot);
-			strcpy(directory,""); // keep track of current directory
-			lastfile=0;        // new directory so start at beginning
-            drawfilelist(fileindex=lastdir);
-            drawselector(lastdir);
-			while( button) usleep(100000); // wait till button released
+		else if (fileindex == (browser.count -1)) { // last file is always ".." so go up a directory
+			fileindex=lastfile=fb_up();
+            drawfilelist(fileindex);
+            drawselector(fileindex);
+			waitbuttonup(); // wait till button released
 		}
 		else {  // we have selected a file so load it
 			bool exitflag=0;
@@ -629,35 +1070,72 @@ void domenus(void) {
 			}
 			if (exitflag) {  // don't load file, go back to root dir
 				lastfile=0;
-				strcpy(directory,"");
+				fb_root();
 			}
 			else {
 				lastfile=fileindex;  // remember where we were
-				char temp2[80];
-				strcpy(temp2,filesroot);  // build the full file path
-				strcat(temp2,"/");
-				strcpy(temp,directory);
-				strcat(temp,"/");
-				strcat(temp,files[fileindex].name);
-				strcpy(samp[topmenuindex].filename,temp); // save directory/filename
-				strcat(temp2,temp);
-				samp[topmenuindex].state=SUSPENDED;  // turn off access to this sample temporarily
-				//printf("loading %s \n",temp2);
-				audioFile[topmenuindex].load(temp2); // **** need error checking here for filename
-				//audioFile[topmenuindex].printSummary();
-				samp[topmenuindex].state=SILENT;  // turn access back on
+				if (browser.path[0]) snprintf(temp,PATHLEN,"%s/%s",browser.path,f->name);
+				else snprintf(temp,PATHLEN,"%s",f->name);
+				if (topmenuindex >= NUMSAMPLES) {  // reverb IR - the loader does the FFTs so we don't hold up the UI
+					strcpy(irfilename,temp);
+					ir_request();
+				}
+				else slot_request(topmenuindex,temp);  // the kit loader loads it and the callback swaps it in
 			}
-			topmenu[topmenuindex].submenuindex=0;  // restore submenu from the first item
+			if (topmenuindex < NUMSAMPLES) topmenu[topmenuindex].submenuindex=0;  // restore submenu from the first item
 			drawsubmenus();
 			drawselector(topmenu[topmenuindex].submenuindex);  
 			uistate=SUBSELECT;	
-			while(button) usleep(100000); // wait till button released
+			waitbuttonup(); // wait till button released
 		}
 		
       }
       break;
 
   }
+  // kit loading progress on the right of the title line - redraw the screen when it's done since the filenames will have changed
+  static bool kitshown=0;
+  if ((kitstate == KIT_LOADING) || (kitstate == KIT_READY)) {
+	display.setCursor((DISPLAY_X-7)*DISPLAY_CHAR_WIDTH,0);
+	if (kitloading < 0) display.printf(" S%d   ",-kitloading);  // one sample from the file menu
+	else display.printf(" K%02d %d",kitloading,(int)kitprogress);
+	kitshown=1;
+  }
+  else if (kitshown) {
+	kitshown=0;
+	switch (uistate) {
+	  case TOPSELECT:
+		drawtopmenu(topmenuindex);
+		drawselector(topmenuindex);
+		break;
+	  case SUBSELECT:
+		drawsubmenus();
+		drawselector(topmenu[topmenuindex].submenuindex);
+		break;
+	  case PARAM_INPUT:
+		drawsubmenus();
+		draweditselector(topmenu[topmenuindex].submenuindex);
+		break;
+	  case FILEBROWSER:
+		drawfilelist(fileindex);
+		drawselector(fileindex);
+		break;
+	}
+  }
+  // keep status values on the screen up to date
+  static int statuscount=0;
+  if ((++statuscount >= STATUS_REFRESH) && ((uistate == SUBSELECT) || (uistate == PARAM_INPUT))) {
+	statuscount=0;
+	submenu *sub=topmenu[topmenuindex].submenus;
+	int first=(topmenu[topmenuindex].submenuindex/SUBMENU_LINES)*SUBMENU_LINES;  // page that is showing
+	bool any=0;
+	for (int i=first;(i < first+SUBMENU_LINES) && (i < topmenu[topmenuindex].numsubmenus);++i) if (sub[i].ptype == TYPE_STATUS) any=1;
+	if (any) {
+		statusupdate();
+		for (int i=first;(i < first+SUBMENU_LINES) && (i < topmenu[topmenuindex].numsubmenus);++i) if (sub[i].ptype == TYPE_STATUS) drawsubmenu(i);
+	}
+  }
+  oledupdate();  // one update per pass
 }
 
 
@@ -17,14 +17,11 @@
 
 
 #define MAX_DEV_STR_LEN               32
-#define MAX_MSG_SIZE                1024
 
 /* change this definition for the correct port */
 //#define _POSIX_SOURCE 1 /* POSIX compliant source */
 
 
-int serial;
-
 void parse_midi_command(char *buf)
 {
 	/*
@@ -70,7 +67,8 @@ void parse_midi_command(char *buf)
 				if ((samp[i].midichannel == (channel+1)) && (samp[i].state != SUSPENDED)) {
 					switch (samp[i].midimode) {
 						case PITCHED:
-							samp[i].state=SILENT;
+							slicereq[i]=0;  /* a note too short to have started yet */
+							samp[i].state=releasestate(i);  /* looped samples play out their tail */
 							break;
 						case PERCUSSION:
 							//samp[i].state=SILENT;  // don't choke percussive sounds
@@ -85,21 +83,27 @@ void parse_midi_command(char *buf)
 			break;
 			
 		case 0x90:
+			if (param2 == 0) {  /* note on with 0 velocity is a note off - usual with running status */
+				buf[0] = 0x80 | channel;
+				parse_midi_command(buf);
+				break;
+			}
 			if (debug) printf("Serial  0x%x Note on            %03u %03u %03u\n", operation, channel, param1, param2);
 			for (i=0; i< NUMSAMPLES;++i) { // find sample(s) with matching MIDI channel
 				if ((samp[i].midichannel == (channel+1)) && (samp[i].state != SUSPENDED)) {
 					switch (samp[i].midimode) {
 						case PITCHED:
 							samp[i].midinote=param1; // set pitch
-							if (samp[i].speed >= 0) samp[i].phasor=0.0; // case of playing forwards
-							else samp[i].phasor=1.0; // case of playing backwards	
-							samp[i].state=PLAYING;
+							slice_request(i,SLICE_TRIG);  // renderer starts it on the next block
+							break;
 						case PERCUSSION:
+							if ((samp[i].slicemode == SLICENOTE) && (param1 >= samp[i].note)) { /* notes from the trigger note up play the slices */
+								slice_request(i,param1-samp[i].note);  // ignored if there is no slice for the note
+								break;
+							}
 							if (samp[i].note == param1) { // in percussion mode we have to match the midi trigger note
 								samp[i].midinote=samp[i].note; // reset midinote to default so pitch doesn't change
-								if (samp[i].speed >= 0) samp[i].phasor=0.0; // case of playing forwards
-								else samp[i].phasor=1.0; // case of playing backwards	
-								samp[i].state=PLAYING;
+								slice_request(i,SLICE_TRIG);  // renderer starts it on the next block
 							}
 							break;
 						case OFF:
@@ -113,23 +117,31 @@ void parse_midi_command(char *buf)
 			
 		case 0xA0:
 			if (debug) printf("Serial  0x%x Pressure change    %03u %03u %03u\n", operation, channel, param1, param2);
+			midimap_event(SRC_POLYAT,channel+1,param1,(float)param2/127);
 			break;
 
 		case 0xB0:
 			if (debug) printf("Serial  0x%x Controller change  %03u %03u %03u\n", operation, channel, param1, param2);
+			midimap_event(SRC_CC,channel+1,param1,(float)param2/127);
 			break;
 
 		case 0xC0:
 			if (debug) printf("Serial  0x%x Program change     %03u %03u\n", operation, channel, param1);
+			if ((kitchannel == (channel+1)) && (param1 < KIT_MAX)) { // program 0 is kit 1
+				kitnumber=param1+1;  // so the kits menu shows it
+				kit_request(kitnumber);  // loads in the background
+			}
 			break;
 
 		case 0xD0:
 			if (debug) printf("Serial  0x%x Channel change     %03u %03u\n", operation, channel, param1);
+			midimap_event(SRC_CHANAT,channel+1,0,(float)param1/127);
 			break;
 
 		case 0xE0:
 			param1 = (param1 & 0x7F) + ((param2 & 0x7F) << 7);
 			if (debug) printf("Serial  0x%x Pitch bend         %03u %05i\n", operation, channel, param1);
+			midimap_event(SRC_BEND,channel+1,0,(float)param1/16383);  // full 14 bits
 			break;
 
 		/* Not implementing system commands (0xF0) */
@@ -142,85 +154,26 @@ void parse_midi_command(char *buf)
 }
 
 
-void* read_midi_from_serial_port(void* seq) 
+/* system realtime - clock and transport. time is when the byte arrived */
+void parse_midi_realtime(unsigned char byte, struct timespec *time)
 {
-	char buf[3], msg[MAX_MSG_SIZE];
-	int i, msglen;
-	static int serialdebug=0;
-	
-	/* Lets first fast forward to first status byte... */
-	do read(serial, buf, 1);
-	while (buf[0] >> 7 == 0);
-
-
-	while (1) 
-	{
-		/* 
-		 * super-debug mode: only print to screen whatever
-		 * comes through the serial port.
-		 */
-
-		if (serialdebug) 
-		{
-			read(serial, buf, 1);
-			printf("%x\t", (int) buf[0]&0xFF);
-			fflush(stdout);
-			continue;
-		}
-
-		/* 
-		 * so let's align to the beginning of a midi command.
-		 */
-
-		int i = 1;
-
-		while (i < 3) {
-			read(serial, buf+i, 1);
-
-			if (buf[i] >> 7 != 0) {
-				/* Status byte received and will always be first bit!*/
-				buf[0] = buf[i];
-				i = 1;
-			} else {
-				/* Data byte received */
-				if (i == 2) {
-					/* It was 2nd data byte so we have a MIDI event
-					   process! */
-					i = 3;
-				} else {
-					/* Lets figure out are we done or should we read one more byte. */
-					if ((buf[0] & 0xF0) == 0xC0 || (buf[0] & 0xF0) == 0xD0) {
-						i = 3;
-					} else {
-						i = 2;
-					}
-				}
-			}
-
-		}
-
-		/* print comment message (the ones that start with 0xFF 0x00 0x00 */
-		if (buf[0] == (char) 0xFF && buf[1] == (char) 0x00 && buf[2] == (char) 0x00)
-		{
-			read(serial, buf, 1);
-			msglen = buf[0];
-			if (msglen > MAX_MSG_SIZE-1) msglen = MAX_MSG_SIZE-1;
-
-			read(serial, msg, msglen);
-
-			//if (arguments.silent) continue;
-
-			/* make sure the string ends with a null character */
-			msg[msglen] = 0;
-
-			puts("0xFF Non-MIDI message: ");
-			puts(msg);
-			putchar('\n');
-			fflush(stdout);
-		}
-
-		/* parse MIDI message */
-		else parse_midi_command(buf);
+	static int debug=0;
+	if (debug) printf("Realtime 0x%x\n", byte);
+	switch (byte) {
+		case 0xF8:  /* clock */
+			clock_tick(time);
+			break;
+		case 0xFA:  /* start */
+			clock_start();
+			break;
+		case 0xFB:  /* continue */
+			clock_continue();
+			break;
+		case 0xFC:  /* stop */
+			clock_stop();
+			break;
+		default:
+			break;
 	}
 }
 
@@ -0,0 +1,119 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// MIDI clock sync
+// the MIDI dispatcher thread timestamps every 0xF8 clock and works out the tempo from them
+// clocks over USB or from a busy sequencer jitter by a ms or so which is a lot at 24 per beat
+// so the beat period is measured over the last 24 clocks and then smoothed, unless the tempo jumps
+// a looped slot with "Sync Beats" set plays its sample over exactly that many beats
+// the dispatcher publishes the phase increment for each synced slot - that's all the audio thread sees
+// synced slots restart every "Sync Beats" beats counted from the last 0xFA start so they stay in phase with the rig
+
+#define CLOCK_PPQN 24          // MIDI clocks per beat
+#define CLOCK_SMOOTH 0.1       // tempo smoothing - fraction of the new measurement used each clock
+#define CLOCK_JUMP 0.05        // tempo change bigger than this fraction is a real change, not jitter
+#define CLOCK_TIMEOUT 0.5      // seconds without a clock before we stop syncing
+
+double clocktimes[CLOCK_PPQN+1];   // arrival time of the last beat's worth of clocks in seconds
+int clockcount=0;                  // clocks received since the last start
+int clockvalid=0;                  // number of entries in clocktimes
+double clockperiod=0;              // smoothed beat period in seconds, 0 if we don't know it
+double lastclock=0;                // time of the last clock
+bool clockrunning=0;               // between start/continue and stop
+
+std::atomic<float> syncinc[NUMSAMPLES];      // phase increment for synced slots, 0 if not synced
+std::atomic<bool> syncrestart[NUMSAMPLES];   // restart the slot on the next block
+int16_t syncbeats[NUMSAMPLES];               // beats syncinc was worked out for - the menu can change samp[].syncbeats any time
+std::atomic<int16_t> clockbpm(0);            // for the display
+
+double clock_seconds(struct timespec *t) {
+	return t->tv_sec+t->tv_nsec*1e-9;
+}
+
+// work out the phase increment for each synced slot from the tempo
+void clock_publish(void) {
+	for (int s=0;s<NUMSAMPLES;++s) {
+		int16_t beats=samp[s].syncbeats;  // read it once
+		if ((clockperiod > 0) && (beats > 0) && (samp[s].mode == LOOPED)) {
+			syncbeats[s]=beats;
+			syncinc[s]=1.0/(clockperiod*beats*SAMPLE_RATE);
+		}
+		else {
+			syncbeats[s]=0;
+			syncinc[s]=0;
+		}
+	}
+	clockbpm=(clockperiod > 0) ? (int16_t)lrint(60.0/clockperiod) : 0;
+}
+
+// a MIDI clock arrived
+void clock_tick(struct timespec *time) {
+	double t=clock_seconds(time);
+	if (t-lastclock > CLOCK_TIMEOUT) clockvalid=0;  // clock just started again - old times are no good
+	lastclock=t;
+
+	memmove(&clocktimes[0],&clocktimes[1],CLOCK_PPQN*sizeof(double));
+	clocktimes[CLOCK_PPQN]=t;
+	if (clockvalid <= CLOCK_PPQN) ++clockvalid;
+	if (clockvalid > CLOCK_PPQN) {  // have a beat's worth
+		double period=clocktimes[CLOCK_PPQN]-clocktimes[0];
+		if ((clockperiod == 0) || (fabs(period-clockperiod) > clockperiod*CLOCK_JUMP)) clockperiod=period;  // tempo change
+		else clockperiod+=(period-clockperiod)*CLOCK_SMOOTH;
+		clock_publish();
+	}
+
+	if (clockrunning) {
+		for (int s=0;s<NUMSAMPLES;++s) {  // restart synced loops on their boundaries
+			if ((syncbeats[s] > 0) && ((clockcount % (CLOCK_PPQN*syncbeats[s])) == 0)) syncrestart[s]=1;
+		}
+		++clockcount;
+	}
+}
+
+// transport messages
+void clock_start(void) {
+	clockcount=0;  // next clock is the downbeat
+	clockrunning=1;
+}
+
+void clock_continue(void) {
+	clockrunning=1;
+}
+
+void clock_stop(void) {
+	clockrunning=0;
+}
+
+// called by the MIDI dispatcher when nothing has come in for a while
+void clock_timeout(struct timespec *now) {
+	if ((clockperiod > 0) && (clock_seconds(now)-lastclock > CLOCK_TIMEOUT)) {  // clock has gone away - play at normal speed
+		clockperiod=0;
+		clockvalid=0;
+		clock_publish();
+	}
+}
@@ -0,0 +1,235 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// MIDI inputs
+// any number of serial ports (UART, USB serial, a pty for testing) and ALSA rawmidi ports (USB MIDI, snd-virmidi) can be used at once
+// pick them with -m on the command line - a name starting with / is a serial device, anything else is an ALSA rawmidi name like hw:1,0
+// each input has its own reader thread and byte stream parser, complete messages are timestamped and go into one queue
+// a dispatcher thread takes them off the queue in order and hands them to parse_midi_command()
+// to test without hardware: "socat -d -d pty,raw,echo=0 pty,raw,echo=0" and -m /dev/pts/N, or modprobe snd-virmidi and -m hw:N,0
+
+#define MIDI_MAXINPUTS 4
+#define MIDI_QUEUESIZE 1024 // must be a power of 2
+#define MIDI_READSIZE 256   // bytes per read() - a dense controller stream arrives in one go
+
+enum midiinputtypes {MIDIIN_SERIAL,MIDIIN_ALSA};
+
+// byte stream parser state - handles running status, system realtime bytes in the middle of a message
+// and skips SysEx and the system common messages we don't use
+struct midiparser {
+	unsigned char status;   // running status, 0 if none
+	unsigned char data[2];
+	int count;              // data bytes received
+	int needed;             // data bytes this message needs
+	bool sysex;             // skipping SysEx or a system common message
+};
+
+struct midiinput {
+	int type;
+	char name[PATHLEN];
+	int fd;                 // serial port
+	snd_rawmidi_t *rawmidi; // ALSA port
+	struct pollfd pfd;
+	midiparser parser;
+	pthread_t thread;
+} midiinputs[MIDI_MAXINPUTS];
+
+int nummidiinputs=0;
+
+struct midievent {
+	struct timespec time;   // when it arrived
+	unsigned char buf[3];   // channel message, or a realtime byte in buf[0]
+	bool realtime;
+};
+
+struct midievent midiqueue[MIDI_QUEUESIZE];
+uint32_t midiqhead=0,midiqtail=0;
+uint32_t midiqdropped=0;
+pthread_mutex_t midiqlock = PTHREAD_MUTEX_INITIALIZER;  // several readers write the queue so it needs a lock
+pthread_cond_t midiqcond = PTHREAD_COND_INITIALIZER;
+
+void midi_queue_push(struct timespec *time, unsigned char *buf, bool realtime) {
+	pthread_mutex_lock(&midiqlock);
+	if (midiqhead-midiqtail < MIDI_QUEUESIZE) {
+		midievent *e=&midiqueue[midiqhead & (MIDI_QUEUESIZE-1)];
+		e->time=*time;
+		memcpy(e->buf,buf,3);
+		e->realtime=realtime;
+		++midiqhead;
+		pthread_cond_signal(&midiqcond);
+	}
+	else ++midiqdropped;  // dispatcher is way behind
+	pthread_mutex_unlock(&midiqlock);
+}
+
+// number of data bytes for a status byte
+int midi_datalen(unsigned char status) {
+	switch (status & 0xF0) {
+		case 0xC0:
+		case 0xD0:
+			return 1;
+		case 0xF0:
+			if ((status == 0xF1) || (status == 0xF3)) return 1;  // MTC quarter frame, song select
+			if (status == 0xF2) return 2;  // song position
+			return 0;
+		default:
+			return 2;
+	}
+}
+
+void midi_parse_byte(midiparser *p, unsigned char byte, struct timespec *time) {
+	unsigned char buf[3];
+
+	if (byte >= 0xF8) {  // realtime - doesn't affect anything else
+		buf[0]=byte;
+		buf[1]=buf[2]=0;
+		midi_queue_push(time,buf,1);
+		return;
+	}
+	if (byte & 0x80) {  // status byte
+		p->count=0;
+		if (byte >= 0xF0) {  // system common cancels running status
+			p->status=0;
+			p->sysex=1;  // skip its data bytes - 0xF7 or the next status byte ends it
+			return;
+		}
+		p->status=byte;
+		p->sysex=0;
+		p->needed=midi_datalen(byte);
+		return;
+	}
+	if (p->sysex || (p->status == 0)) return;  // data we don't want or can't place
+
+	p->data[p->count++]=byte;
+	if (p->count < p->needed) return;
+
+	buf[0]=p->status;
+	buf[1]=p->data[0];
+	buf[2]=(p->needed > 1) ? p->data[1] : 0;
+	p->count=0;  // status stays for the next message - running status
+	midi_queue_push(time,buf,0);
+}
+
+// reader thread - one per input
+// sleeps in poll() and takes everything that's there in one read
+void *midi_input_thread(void *arg) {
+	midiinput *in=(midiinput *)arg;
+	unsigned char buf[MIDI_READSIZE];
+	struct timespec now;
+	int i,n;
+
+	while (1) {
+		if (poll(&in->pfd,1,-1) <= 0) continue;
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		if (in->type == MIDIIN_SERIAL) {
+			n=read(in->fd,buf,sizeof(buf));
+			if (n < 0) n=-errno;  // same as rawmidi gives
+		}
+		else n=snd_rawmidi_read(in->rawmidi,buf,sizeof(buf));
+		if ((n == -EAGAIN) || (n == -EINTR)) continue;  // nothing there after all, or a signal - try again
+		if (n == 0) {  // end of file - device went away
+			printf("MIDI input %s closed\n",in->name);
+			return 0;
+		}
+		if (n < 0) {  // -ENODEV, -EIO and the like - it's not coming back
+			printf("MIDI input %s failed: %s\n",in->name,strerror(-n));
+			return 0;
+		}
+		for (i=0;i<n;++i) midi_parse_byte(&in->parser,buf[i],&now);
+	}
+}
+
+// dispatcher thread - feeds the queued messages to the MIDI handlers in order
+void *midi_dispatch_thread(void *arg) {
+	midievent e;
+	while (1) {
+		pthread_mutex_lock(&midiqlock);
+		while (midiqtail == midiqhead) {
+			struct timespec wake;
+			clock_gettime(CLOCK_REALTIME,&wake);  // condition variables time out on the realtime clock
+			wake.tv_nsec+=100000000;  // check the MIDI clock 10 times a second even if nothing comes in
+			if (wake.tv_nsec >= 1000000000) {
+				wake.tv_nsec-=1000000000;
+				++wake.tv_sec;
+			}
+			if (pthread_cond_timedwait(&midiqcond,&midiqlock,&wake) == ETIMEDOUT) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC,&now);
+				pthread_mutex_unlock(&midiqlock);
+				clock_timeout(&now);
+				pthread_mutex_lock(&midiqlock);
+			}
+		}
+		e=midiqueue[midiqtail & (MIDI_QUEUESIZE-1)];
+		++midiqtail;
+		pthread_mutex_unlock(&midiqlock);
+
+		if (e.realtime) parse_midi_realtime(e.buf[0],&e.time);
+		else parse_midi_command((char *)e.buf);
+	}
+	return 0;  // will never get here
+}
+
+// open a MIDI input and start its reader thread
+// returns 0 if it can't be opened - MIDI inputs are all optional
+bool midi_open(const char *name) {
+	if (nummidiinputs >= MIDI_MAXINPUTS) {
+		printf("too many MIDI inputs, ignoring %s\n",name);
+		return 0;
+	}
+	midiinput *in=&midiinputs[nummidiinputs];
+	memset(in,0,sizeof(midiinput));
+	snprintf(in->name,PATHLEN,"%s",name);
+	if (name[0] == '/') {  // serial device
+		in->type=MIDIIN_SERIAL;
+		in->fd=open(name,O_RDWR | O_NOCTTY);
+		if (in->fd < 0) {
+			printf("Can't open MIDI serial %s\n",name);
+			return 0;
+		}
+		midi_init(in->fd);   // set up serial port for MIDI use
+		in->pfd.fd=in->fd;
+		in->pfd.events=POLLIN;
+	}
+	else {  // ALSA rawmidi
+		in->type=MIDIIN_ALSA;
+		int err=snd_rawmidi_open(&in->rawmidi,NULL,name,SND_RAWMIDI_NONBLOCK);
+		if (err < 0) {
+			printf("Can't open ALSA MIDI %s: %s\n",name,snd_strerror(err));
+			return 0;
+		}
+		snd_rawmidi_poll_descriptors(in->rawmidi,&in->pfd,1);
+	}
+	if (pthread_create(&in->thread,NULL,midi_input_thread,in)) {
+		printf("Error:unable to create MIDI thread for %s\n",name);
+		return 0;
+	}
+	printf("MIDI input %s\n",name);
+	++nummidiinputs;
+	return 1;
+}
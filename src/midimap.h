@@ -0,0 +1,146 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// MIDI controller routing
+// a table of routes takes CCs, poly and channel pressure and 14 bit pitch bend to sample parameters
+// each route has its own range and response curve and can be set up with MIDI learn from the menu
+// the MIDI thread scales the controller and puts it in a lock free queue - it never writes samp[]
+// the audio callback empties the queue once per block and glides each parameter to its new value so there's no zipper noise
+// MIDI modulation sits on top of the menu settings:
+// level multiplies the menu level, pan and speed add to theirs, pitch adds +-1 octave, start adds to the start point
+// cutoff and resonance add to the filter settings - 1.0 is the whole range
+
+#define MIDIMAP_ROUTES 16      // number of routes
+#define MIDIQ_SIZE 256         // must be a power of 2
+#define MIDIMAP_SMOOTH 0.010   // parameter glide time constant in seconds
+
+enum mapsources {SRC_CC,SRC_POLYAT,SRC_CHANAT,SRC_BEND};  // enum index must match the text in the menus
+enum maptargets {MAP_LEVEL,MAP_PAN,MAP_SPEED,MAP_PITCH,MAP_START,MAP_CUTOFF,MAP_RESONANCE,MAP_TARGETS};  // enum index must match the text in the menus
+enum mapcurves {CURVE_LIN,CURVE_EXP,CURVE_LOG};
+
+struct midiroute {
+	int16_t slot;      // sample slot 1-8, 0=route not used
+	int16_t source;    // SRC_CC etc
+	int16_t channel;   // MIDI channel 1-16
+	int16_t number;    // CC number or poly pressure note
+	int16_t target;    // MAP_LEVEL etc
+	int16_t min;       // value at controller minimum, -1000 to 1000 = -1.0 to 1.0
+	int16_t max;       // value at controller maximum
+	int16_t curve;     // response curve
+} midiroutes[MIDIMAP_ROUTES];
+
+// modulation values sent to the audio thread
+struct midimapmsg {
+	int8_t slot;    // 0-7
+	int8_t target;
+	float value;
+};
+
+struct midimapqueue {
+	std::atomic<uint32_t> head;  // written by the MIDI thread only
+	std::atomic<uint32_t> tail;  // written by the audio thread only
+	midimapmsg buf[MIDIQ_SIZE];
+} midiq;
+
+float mapgoal[NUMSAMPLES][MAP_TARGETS];  // where each parameter is heading - audio thread only
+float mapvalue[NUMSAMPLES][MAP_TARGETS]; // smoothed value the renderer uses
+float mapdefault[MAP_TARGETS]={1.0,0,0,0,0,0,0};  // no modulation
+
+std::atomic<int16_t> maplearn(-1);  // route waiting for MIDI learn, -1=none
+
+void midimap_init(void) {
+	for (int r=0;r<MIDIMAP_ROUTES;++r) {  // routes start off, sensible defaults for when one is turned on
+		midiroutes[r]={0,SRC_CC,1,1,MAP_LEVEL,0,1000,CURVE_LIN};
+	}
+	for (int s=0;s<NUMSAMPLES;++s) {
+		for (int t=0;t<MAP_TARGETS;++t) mapgoal[s][t]=mapvalue[s][t]=mapdefault[t];
+	}
+}
+
+// queue a value for the audio thread - drops it if the queue is full, the next one will catch up
+void midimap_send(int slot, int target, float value) {
+	uint32_t head=midiq.head.load(std::memory_order_relaxed);
+	if (head-midiq.tail.load(std::memory_order_acquire) >= MIDIQ_SIZE) return;
+	midimapmsg *m=&midiq.buf[head & (MIDIQ_SIZE-1)];
+	m->slot=slot;
+	m->target=target;
+	m->value=value;
+	midiq.head.store(head+1,std::memory_order_release);
+}
+
+// a controller message came in - value is normalized 0-1.0
+// called from the MIDI thread
+void midimap_event(int16_t source, int16_t channel, int16_t number, float value) {
+	int16_t learn=maplearn;
+	if (learn >= 0) {  // this is the controller the route should follow
+		midiroutes[learn].source=source;
+		midiroutes[learn].channel=channel;
+		midiroutes[learn].number=number;
+		maplearn=-1;
+	}
+	for (int r=0;r<MIDIMAP_ROUTES;++r) {
+		midiroute *m=&midiroutes[r];
+		if ((m->slot == 0) || (m->source != source) || (m->channel != channel)) continue;
+		if (((source == SRC_CC) || (source == SRC_POLYAT)) && (m->number != number)) continue;
+		float x=value;
+		switch (m->curve) {
+			case CURVE_EXP: x=x*x; break;        // fine control at the bottom
+			case CURVE_LOG: x=sqrtf(x); break;   // fine control at the top
+			default: break;
+		}
+		float out=((float)m->min+(m->max-m->min)*x)/1000;
+		midimap_send(m->slot-1,m->target,out);
+	}
+}
+
+// empty the queue and move the parameters toward their new values - called by the renderer once per block
+void midimap_update(unsigned long frames) {
+	uint32_t tail=midiq.tail.load(std::memory_order_relaxed);
+	uint32_t head=midiq.head.load(std::memory_order_acquire);
+	while (tail != head) {
+		midimapmsg *m=&midiq.buf[tail & (MIDIQ_SIZE-1)];
+		if ((m->slot >= 0) && (m->slot < NUMSAMPLES) && (m->target >= 0) && (m->target < MAP_TARGETS)) mapgoal[m->slot][m->target]=m->value;
+		++tail;
+	}
+	midiq.tail.store(tail,std::memory_order_release);
+
+	float k=1.0f-expf(-(float)frames/(SAMPLE_RATE*MIDIMAP_SMOOTH));  // one pole glide, same time whatever the block size
+	for (int s=0;s<NUMSAMPLES;++s) {
+		for (int t=0;t<MAP_TARGETS;++t) mapvalue[s][t]+=(mapgoal[s][t]-mapvalue[s][t])*k;
+		mapvalue[s][MAP_START]=mapgoal[s][MAP_START];  // only used at note start so no need to glide it
+	}
+}
+
+// where playback starts - menu start point plus any MIDI modulation, from the end if playing backwards
+double startpos(int s) {
+	double start=(double)samp[s].start/1000+mapvalue[s][MAP_START];
+	if (start < 0) start=0;
+	if (start > 0.999) start=0.999;
+	if (samp[s].speed >= 0) return start;
+	return 1.0-start;
+}
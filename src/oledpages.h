@@ -0,0 +1,141 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+// SSD1306 driver with partial updates and its own display thread
+// ArduiPi_OLED::display() sends the whole 1K framebuffer every time, even if all we did was move the menu selector
+// this keeps its own framebuffers and tracks which columns of each 8 pixel page have changed
+// the UI draws into the back buffer and calls display() which just copies the changed bytes to the front buffer - no SPI
+// displaythread() sends the changed parts of the front buffer at no more than OLED_FPS
+// so any number of UI changes between frames get coalesced and the UI never waits on SPI
+// GFX text and graphics calls all end up in drawPixel() so they just work
+
+#define OLED_WIDTH 128
+#define OLED_HEIGHT 64
+#define OLED_PAGES (OLED_HEIGHT/8)
+#define OLED_FPS 30  // max display frame rate
+
+class PagedOLED : public ArduiPi_OLED {
+public:
+	uint8_t fb[OLED_PAGES][OLED_WIDTH];  // back buffer in SSD1306 page order - 1 byte is 8 vertical pixels
+	uint8_t dirtylo[OLED_PAGES];  // first changed column in each page
+	uint8_t dirtyhi[OLED_PAGES];  // last changed column in each page
+	uint8_t dirty;                // bit per page that has changed since the last display()
+
+	uint8_t front[OLED_PAGES][OLED_WIDTH];  // what the display thread sends
+	uint8_t frontlo[OLED_PAGES];
+	uint8_t fronthi[OLED_PAGES];
+	uint8_t frontdirty;               // bit per page the display thread needs to send
+	pthread_mutex_t framelock=PTHREAD_MUTEX_INITIALIZER;  // protects the front buffer - only ever held for a memcpy
+
+	void drawPixel(int16_t x, int16_t y, uint16_t color) {
+		if ((x < 0) || (x >= OLED_WIDTH) || (y < 0) || (y >= OLED_HEIGHT)) return;
+		uint8_t page=y>>3;
+		uint8_t bit=1<<(y&7);
+		uint8_t old=fb[page][x];
+		switch (color) {
+			case WHITE: fb[page][x]|=bit; break;
+			case BLACK: fb[page][x]&=~bit; break;
+			case INVERSE: fb[page][x]^=bit; break;
+		}
+		if (fb[page][x] != old) markdirty(&dirty,dirtylo,dirtyhi,page,x,x);  // redrawing the same pixels costs nothing
+	}
+
+	void clearDisplay(void) {
+		memset(fb,0,sizeof(fb));
+		for (int p=0;p<OLED_PAGES;++p) markdirty(&dirty,dirtylo,dirtyhi,p,0,OLED_WIDTH-1);
+	}
+
+	static void markdirty(uint8_t *mask, uint8_t *lo, uint8_t *hi, uint8_t page, uint8_t first, uint8_t last) {
+		if (!(*mask & (1<<page))) {
+			lo[page]=first;
+			hi[page]=last;
+			*mask|=1<<page;
+		}
+		else {
+			if (first < lo[page]) lo[page]=first;
+			if (last > hi[page]) hi[page]=last;
+		}
+	}
+
+	// publish what has been drawn since last time to the front buffer
+	void display(void) {
+		if (dirty == 0) return;
+		pthread_mutex_lock(&framelock);
+		for (int p=0;p<OLED_PAGES;++p) {
+			if (!(dirty & (1<<p))) continue;
+			memcpy(&front[p][dirtylo[p]],&fb[p][dirtylo[p]],dirtyhi[p]-dirtylo[p]+1);
+			markdirty(&frontdirty,frontlo,fronthi,p,dirtylo[p],dirtyhi[p]);
+		}
+		dirty=0;
+		pthread_mutex_unlock(&framelock);
+	}
+
+	// send the changed column range of each changed page of the front buffer
+	// takes a snapshot so the UI can keep drawing, then takes the SPI lock one page at a time so the CV reads don't wait long
+	void sendframe(void) {
+		uint8_t buf[OLED_PAGES][OLED_WIDTH];
+		uint8_t lo[OLED_PAGES],hi[OLED_PAGES];
+		uint8_t mask;
+		int p;
+
+		pthread_mutex_lock(&framelock);
+		mask=frontdirty;
+		for (p=0;p<OLED_PAGES;++p) {
+			if (!(mask & (1<<p))) continue;
+			lo[p]=frontlo[p];
+			hi[p]=fronthi[p];
+			memcpy(&buf[p][lo[p]],&front[p][lo[p]],hi[p]-lo[p]+1);
+		}
+		frontdirty=0;
+		pthread_mutex_unlock(&framelock);
+
+		for (p=0;p<OLED_PAGES;++p) {
+			if (!(mask & (1<<p))) continue;
+			pthread_mutex_lock(&spilock);
+			sendCommand(0x21);  // column address range
+			sendCommand(lo[p]);
+			sendCommand(hi[p]);
+			sendCommand(0x22);  // page address range
+			sendCommand(p);
+			sendCommand(p);
+			bcm2835_gpio_write(OLED_SPI_DC, HIGH);  // data mode
+			bcm2835_spi_writenb((const char *)&buf[p][lo[p]], hi[p]-lo[p]+1);
+			pthread_mutex_unlock(&spilock);
+		}
+	}
+};
+
+PagedOLED display;  // Instantiate the display
+
+// display thread - sends changes to the OLED at up to OLED_FPS
+void *displaythread(void *threadid) {
+	while (1) {
+		display.sendframe();
+		usleep(1000000/OLED_FPS);
+	}
+	return 0;  // will never get here
+}
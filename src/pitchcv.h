@@ -0,0 +1,155 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+// 1V/octave pitch CV
+// each CV channel is calibrated with two reference voltages - 1V and 3V - the A/D readings are saved in CVCAL_FILE
+// the calibrated voltage can be quantized to a scale and is then converted to a pitch ratio with a lookup table
+// 3.0V is the nominal pitch of the sample, same as before
+
+#define CVCAL_FILE "./cvcal.txt"  // calibration data lives here
+#define CVCAL_SCALE 2      // calibration readings are stored as A/D code * CVCAL_SCALE for a bit more resolution
+#define CVCAL_READS 32     // number of scans to average when reading a reference voltage
+#define EXP2_TABLE_BITS 10 // 2^x table resolution - 1024 points with interpolation is well under 0.01 cents
+
+struct cvcalibration {
+	int16_t code1v;  // A/D reading with 1V in, times CVCAL_SCALE
+	int16_t code3v;  // A/D reading with 3V in, times CVCAL_SCALE
+} cvcal[8];
+
+float cvgain[8];    // volts per A/D code, calculated from the calibration
+float cvoffset[8];  // volts at A/D code 0
+
+float exp2table[(1<<EXP2_TABLE_BITS)+1];
+
+int16_t scalemask=0xAB5;   // custom scale - bit 0 is C, bit 11 is B. defaults to major
+uint16_t scalemasks[]={0,0xFFF,0xAB5,0x5AD,0}; // notes in each scale - custom is filled in from scalemask
+int8_t quantoffset[5][12];  // semitones to move each note to get to the nearest note in the scale
+
+// build the 2^x table for x in 0 to 1.0
+void exp2_init(void) {
+	for (int i=0;i<=(1<<EXP2_TABLE_BITS);++i) exp2table[i]=powf(2.0,(float)i/(1<<EXP2_TABLE_BITS));
+}
+
+// 2^x from the table - the integer part of x goes straight into the exponent
+float exp2lut(float x) {
+	float fl=floorf(x);
+	float f=(x-fl)*(1<<EXP2_TABLE_BITS);
+	int i=(int)f;
+	if (i >= (1<<EXP2_TABLE_BITS)) {  // x a hair under an integer rounds x-fl up to 1.0 - use the top of the table
+		i=(1<<EXP2_TABLE_BITS)-1;
+		f=(float)(1<<EXP2_TABLE_BITS);
+	}
+	float y=exp2table[i]+(exp2table[i+1]-exp2table[i])*(f-i);
+	return ldexpf(y,(int)fl);
+}
+
+// build the quantizer lookup - for each note of the octave find the nearest note in the scale, rounding down on a tie
+void quant_init(void) {
+	scalemasks[QCUSTOM]=scalemask & 0xFFF;
+	for (int sc=0;sc<5;++sc) {
+		for (int n=0;n<12;++n) {
+			quantoffset[sc][n]=0;
+			if (scalemasks[sc]==0) continue; // empty scale - don't quantize
+			for (int d=0;d<=6;++d) {
+				if (scalemasks[sc] & (1<<((n-d+12)%12))) {quantoffset[sc][n]=-d; break;}
+				if (scalemasks[sc] & (1<<((n+d)%12))) {quantoffset[sc][n]=d; break;}
+			}
+		}
+	}
+}
+
+// recalculate gain and offset for a channel after its calibration changes
+void cvcal_update(int ch) {
+	float c1=(float)cvcal[ch].code1v/CVCAL_SCALE;
+	float c3=(float)cvcal[ch].code3v/CVCAL_SCALE;
+	if (c3-c1 < 1.0) {  // nonsense calibration - use the nominal 0-5V over 4096 codes
+		c1=4096.0/5;
+		c3=4096.0*3/5;
+	}
+	cvgain[ch]=2.0/(c3-c1);  // 2 volts between the reference points
+	cvoffset[ch]=1.0-c1*cvgain[ch];
+}
+
+// set nominal calibration then read the calibration file if there is one
+// file format is one line per channel: channel 1V-reading 3V-reading
+void cvcal_load(void) {
+	int ch,c1,c3;
+	for (ch=0;ch<8;++ch) {
+		cvcal[ch].code1v=(int16_t)(4096.0/5*CVCAL_SCALE);
+		cvcal[ch].code3v=(int16_t)(4096.0*3/5*CVCAL_SCALE);
+	}
+	FILE *f=fopen(CVCAL_FILE,"r");
+	if (f != NULL) {
+		while (fscanf(f,"%d %d %d",&ch,&c1,&c3) == 3) {
+			if ((ch < 1) || (ch > 8)) continue;
+			cvcal[ch-1].code1v=c1;
+			cvcal[ch-1].code3v=c3;
+		}
+		fclose(f);
+	}
+	else printf("no CV calibration file %s, using nominal values\n",CVCAL_FILE);
+	for (ch=0;ch<8;++ch) cvcal_update(ch);
+}
+
+void cvcal_save(void) {
+	FILE *f=fopen(CVCAL_FILE,"w");
+	if (f == NULL) {
+		printf("Can't write %s\n",CVCAL_FILE);
+		return;
+	}
+	for (int ch=0;ch<8;++ch) fprintf(f,"%d %d %d\n",ch+1,cvcal[ch].code1v,cvcal[ch].code3v);
+	fclose(f);
+}
+
+// average a channel's A/D reading over several scans for calibration
+// called from the UI thread
+int16_t cvcal_measure(int ch) {
+	int32_t sum=0;
+	for (int i=0;i<CVCAL_READS;++i) {
+		read_cvs();
+		sum+=cvraw[ch];
+		usleep(1000);
+	}
+	return (int16_t)((sum*CVCAL_SCALE+CVCAL_READS/2)/CVCAL_READS);
+}
+
+// calibrated CV voltage on a channel 0-7
+float cvvolts(int ch) {
+	return (float)cvraw[ch]*cvgain[ch]+cvoffset[ch];
+}
+
+// pitch ratio for a channel 0-7 - 3V is nominal pitch
+// scale selects the quantizer
+float pitchcv(int ch, int16_t scale) {
+	float octaves=cvvolts(ch)-3.0;
+	if ((scale > QOFF) && (scale <= QCUSTOM)) {
+		int note=(int)lrintf(octaves*12);  // nearest semitone
+		note+=quantoffset[scale][((note%12)+12)%12];  // nearest note in the scale
+		octaves=(float)note/12;
+	}
+	return exp2lut(octaves);
+}
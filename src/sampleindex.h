@@ -0,0 +1,395 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// sample library index
+// a low priority thread walks filesroot and reads just the headers of every WAV and AIFF file it finds
+// plus one streaming pass over the audio data for the peak level
+// results go in a sorted table in memory and in INDEX_FILE so the next boot only has to look at files that changed
+// a file is re-read when its size or modification time changes, files that have gone away are dropped
+// the browser looks things up in the table - it never touches the files themselves
+// index file is in native byte order - it's a cache, if it's missing or the wrong version it just gets rebuilt
+
+#define INDEX_FILE ".sampleindex"  // in filesroot - dot files don't show in the browser
+#define INDEX_MAGIC 0x58495053     // "SPIX"
+#define INDEX_VERSION 1
+#define INDEX_RESCAN 30            // seconds between rescans of the library
+#define INDEX_MAXDEPTH 16          // max directory nesting we index
+#define INDEX_READSIZE 65536       // read buffer for the peak scan
+
+enum indexformats {FMT_UNKNOWN,FMT_PCM,FMT_FLOAT};  // sample encoding
+
+struct indexrecord {
+	char path[PATHLEN];  // relative to filesroot
+	int64_t mtime;       // file modification time
+	int64_t size;        // file size in bytes
+	uint32_t frames;     // samples per channel
+	uint32_t rate;       // sample rate
+	uint8_t channels;
+	uint8_t bits;
+	uint8_t format;      // FMT_PCM etc
+	uint16_t peak;       // peak level 0-32767 = full scale
+	bool seen;           // found on the current scan
+};
+
+std::vector<indexrecord> sampleindex;  // sorted by path
+pthread_mutex_t indexlock = PTHREAD_MUTEX_INITIALIZER;  // protects sampleindex - never held during file I/O
+uint8_t indexbuf[INDEX_READSIZE];  // only the index thread uses this
+
+bool index_less(const indexrecord &a, const char *path) {
+	return strcmp(a.path,path) < 0;
+}
+
+// position of a path in the index or -1 - call with indexlock held
+int index_find(const char *path) {
+	auto it=std::lower_bound(sampleindex.begin(),sampleindex.end(),path,index_less);
+	if ((it == sampleindex.end()) || strcmp(it->path,path)) return -1;
+	return it-sampleindex.begin();
+}
+
+// copy out the index entry for a file - returns 0 if we don't know it (yet)
+bool index_lookup(const char *path, indexrecord *out) {
+	bool found=0;
+	pthread_mutex_lock(&indexlock);
+	int i=index_find(path);
+	if (i >= 0) {
+		*out=sampleindex[i];
+		found=1;
+	}
+	pthread_mutex_unlock(&indexlock);
+	return found;
+}
+
+// length of a sample in milliseconds or -1 if we don't know it
+int32_t index_msec(const char *path) {
+	indexrecord r;
+	if (!index_lookup(path,&r) || (r.rate == 0)) return -1;
+	return (int32_t)((uint64_t)r.frames*1000/r.rate);
+}
+
+uint32_t index_rd32(const uint8_t *p, bool bigendian) {
+	if (bigendian) return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+	return ((uint32_t)p[3]<<24) | ((uint32_t)p[2]<<16) | ((uint32_t)p[1]<<8) | p[0];
+}
+
+uint16_t index_rd16(const uint8_t *p, bool bigendian) {
+	if (bigendian) return (p[0]<<8) | p[1];
+	return (p[1]<<8) | p[0];
+}
+
+// stream the audio data and find the peak level
+// every sample is left justified into 32 bits so all the integer formats compare the same way
+uint16_t index_peak(FILE *f, long offset, int64_t bytes, int bits, int format, bool bigendian) {
+	int bps=bits/8;
+	uint32_t peak=0;
+	float fpeak=0;
+
+	if ((bps < 1) || (bps > 4) || (format == FMT_UNKNOWN) || ((format == FMT_FLOAT) && (bits != 32))) return 0;
+	if (fseek(f,offset,SEEK_SET)) return 0;
+	while (bytes > 0) {
+		int64_t want=INDEX_READSIZE-(INDEX_READSIZE % bps);
+		if (want > bytes) want=bytes;
+		int n=(int)fread(indexbuf,1,want,f);
+		if (n <= 0) break;
+		bytes-=n;
+		for (int i=0;i+bps <= n;i+=bps) {
+			uint8_t *p=&indexbuf[i];
+			uint32_t u=0;
+			for (int b=0;b<bps;++b) {
+				if (bigendian) u|=(uint32_t)p[b]<<(8*(3-b));
+				else u|=(uint32_t)p[b]<<(8*(4-bps+b));
+			}
+			if (format == FMT_FLOAT) {
+				float v;
+				memcpy(&v,&u,4);
+				v=fabsf(v);
+				if (v > fpeak) fpeak=v;
+			}
+			else {
+				if ((bps == 1) && !bigendian) u^=0x80000000;  // 8 bit WAV is unsigned
+				int32_t v=(int32_t)u;
+				uint32_t a=(v < 0) ? (uint32_t)(-(int64_t)v) : (uint32_t)v;
+				if (a > peak) peak=a;
+			}
+		}
+	}
+	if (format == FMT_FLOAT) peak=(fpeak >= 1.0) ? 0x80000000 : (uint32_t)(fpeak*2147483648.0);
+	peak>>=16;
+	return (peak > 32767) ? 32767 : peak;
+}
+
+// read the header of a WAV file - walks the chunk list with seeks so it never reads the audio
+bool index_parsewav(FILE *f, int64_t filesize, indexrecord *r) {
+	uint8_t h[40];
+	long dataoffset=-1;
+	int64_t datasize=0;
+	bool havefmt=0;
+
+	if (fseek(f,12,SEEK_SET)) return 0;
+	while (fread(h,1,8,f) == 8) {
+		uint32_t size=index_rd32(h+4,0);
+		long start=ftell(f);
+		if (!memcmp(h,"fmt ",4)) {
+			size_t n=(size < sizeof(h)) ? size : sizeof(h);
+			if ((fread(h,1,n,f) != n) || (n < 16)) return 0;
+			uint16_t fmt=index_rd16(h,0);
+			if ((fmt == 0xFFFE) && (n >= 26)) fmt=index_rd16(h+24,0);  // WAVE_FORMAT_EXTENSIBLE - real format is in the subformat GUID
+			r->format=(fmt == 1) ? FMT_PCM : (fmt == 3) ? FMT_FLOAT : FMT_UNKNOWN;
+			r->channels=index_rd16(h+2,0);
+			r->rate=index_rd32(h+4,0);
+			r->bits=index_rd16(h+14,0);
+			havefmt=1;
+		}
+		else if (!memcmp(h,"data",4)) {
+			dataoffset=start;
+			datasize=size;
+			if (datasize > filesize-start) datasize=filesize-start;  // streamed files can have a bogus size
+		}
+		if (havefmt && (dataoffset >= 0)) break;
+		if (fseek(f,start+size+(size & 1),SEEK_SET)) break;  // chunks are padded to even length
+	}
+	if (!havefmt || (dataoffset < 0) || (r->channels == 0) || (r->bits < 8)) return 0;
+	r->frames=datasize/(r->channels*(r->bits/8));
+	r->peak=index_peak(f,dataoffset,datasize,r->bits,r->format,0);
+	return 1;
+}
+
+// read the header of an AIFF or AIFC file
+bool index_parseaiff(FILE *f, int64_t filesize, bool aifc, indexrecord *r) {
+	uint8_t h[24];
+	long dataoffset=-1;
+	int64_t datasize=0;
+	bool havecomm=0;
+	bool bigendian=1;
+
+	if (fseek(f,12,SEEK_SET)) return 0;
+	while (fread(h,1,8,f) == 8) {
+		uint32_t size=index_rd32(h+4,1);
+		long start=ftell(f);
+		if (!memcmp(h,"COMM",4)) {
+			size_t n=(size < sizeof(h)) ? size : sizeof(h);
+			if ((fread(h,1,n,f) != n) || (n < 18)) return 0;
+			r->channels=index_rd16(h,1);
+			r->frames=index_rd32(h+2,1);
+			r->bits=index_rd16(h+6,1);
+			int exponent=((h[8] & 0x7F)<<8) | h[9];  // sample rate is an 80 bit IEEE extended float
+			uint64_t mantissa=((uint64_t)index_rd32(h+10,1)<<32) | index_rd32(h+14,1);
+			r->rate=(uint32_t)ldexp((double)mantissa,exponent-16383-63);
+			r->format=FMT_PCM;
+			if (aifc && (n >= 22)) {  // compression type
+				if (!memcmp(h+18,"sowt",4)) bigendian=0;  // little endian PCM
+				else if (!memcmp(h+18,"fl32",4) || !memcmp(h+18,"FL32",4)) r->format=FMT_FLOAT;
+				else if (memcmp(h+18,"NONE",4)) r->format=FMT_UNKNOWN;
+			}
+			havecomm=1;
+		}
+		else if (!memcmp(h,"SSND",4)) {
+			if (fread(h,1,8,f) != 8) return 0;
+			uint32_t offset=index_rd32(h,1);
+			dataoffset=start+8+offset;
+			datasize=(int64_t)size-8-offset;
+			if (datasize > filesize-dataoffset) datasize=filesize-dataoffset;
+		}
+		if (havecomm && (dataoffset >= 0)) break;
+		if (fseek(f,start+size+(size & 1),SEEK_SET)) break;
+	}
+	if (!havecomm || (dataoffset < 0) || (datasize < 0)) return 0;
+	r->peak=index_peak(f,dataoffset,datasize,r->bits,r->format,bigendian);
+	return 1;
+}
+
+// fill in an index record from the file - runs on the index thread only
+bool index_parsefile(const char *fullpath, int64_t filesize, indexrecord *r) {
+	uint8_t h[12];
+	bool ok=0;
+	FILE *f=fopen(fullpath,"rb");
+	if (f == NULL) return 0;
+	r->frames=r->rate=0;
+	r->channels=r->bits=0;
+	r->format=FMT_UNKNOWN;
+	r->peak=0;
+	if (fread(h,1,12,f) == 12) {
+		if (!memcmp(h,"RIFF",4) && !memcmp(h+8,"WAVE",4)) ok=index_parsewav(f,filesize,r);
+		else if (!memcmp(h,"FORM",4) && !memcmp(h+8,"AIFF",4)) ok=index_parseaiff(f,filesize,0,r);
+		else if (!memcmp(h,"FORM",4) && !memcmp(h+8,"AIFC",4)) ok=index_parseaiff(f,filesize,1,r);
+	}
+	fclose(f);
+	return ok;
+}
+
+// is this a file type we index?
+bool index_wanted(const char *name) {
+	const char *ext=strrchr(name,'.');
+	if (ext == NULL) return 0;
+	return !strcasecmp(ext,".wav") || !strcasecmp(ext,".wave") || !strcasecmp(ext,".aif") || !strcasecmp(ext,".aiff") || !strcasecmp(ext,".aifc");
+}
+
+// read the index file into memory - called once before the first scan
+void index_load(void) {
+	char temp[PATHLEN];
+	uint32_t magic,count;
+	uint16_t version,len;
+	indexrecord r;
+
+	snprintf(temp,PATHLEN,"%s/%s",filesroot,INDEX_FILE);
+	FILE *f=fopen(temp,"rb");
+	if (f == NULL) return;  // first time - the scan will build it
+	if ((fread(&magic,4,1,f) != 1) || (fread(&version,2,1,f) != 1) || (fread(&count,4,1,f) != 1) ||
+		(magic != INDEX_MAGIC) || (version != INDEX_VERSION)) {
+		printf("sample index %s is stale, rebuilding\n",temp);
+		fclose(f);
+		return;
+	}
+	std::vector<indexrecord> loaded;
+	loaded.reserve(std::min(count,65536u));  // the count could be garbage - push_back grows it if there really are more
+	for (uint32_t i=0;i<count;++i) {
+		if ((fread(&len,2,1,f) != 1) || (len >= PATHLEN) || (fread(r.path,1,len,f) != (size_t)len)) break;
+		r.path[len]=0;
+		if ((fread(&r.mtime,8,1,f) != 1) || (fread(&r.size,8,1,f) != 1) || (fread(&r.frames,4,1,f) != 1) ||
+			(fread(&r.rate,4,1,f) != 1) || (fread(&r.channels,1,1,f) != 1) || (fread(&r.bits,1,1,f) != 1) ||
+			(fread(&r.format,1,1,f) != 1) || (fread(&r.peak,2,1,f) != 1)) break;
+		r.seen=0;
+		loaded.push_back(r);
+	}
+	fclose(f);
+	std::sort(loaded.begin(),loaded.end(),[](const indexrecord &a, const indexrecord &b) {return strcmp(a.path,b.path) < 0;});
+	pthread_mutex_lock(&indexlock);
+	sampleindex.swap(loaded);
+	pthread_mutex_unlock(&indexlock);
+}
+
+// write the index file - goes to a temp file first so a power cut can't leave half an index
+void index_save(void) {
+	char temp[PATHLEN],temp2[PATHLEN];
+	uint32_t magic=INDEX_MAGIC,count;
+	uint16_t version=INDEX_VERSION,len;
+
+	pthread_mutex_lock(&indexlock);
+	std::vector<indexrecord> copy(sampleindex);  // don't hold the lock while we write
+	pthread_mutex_unlock(&indexlock);
+
+	snprintf(temp,PATHLEN,"%s/%s",filesroot,INDEX_FILE);
+	snprintf(temp2,PATHLEN,"%s/%s.tmp",filesroot,INDEX_FILE);
+	FILE *f=fopen(temp2,"wb");
+	if (f == NULL) {
+		printf("Can't write %s\n",temp2);
+		return;
+	}
+	count=copy.size();
+	fwrite(&magic,4,1,f);
+	fwrite(&version,2,1,f);
+	fwrite(&count,4,1,f);
+	for (auto &r : copy) {
+		len=strlen(r.path);
+		fwrite(&len,2,1,f);
+		fwrite(r.path,1,len,f);
+		fwrite(&r.mtime,8,1,f);
+		fwrite(&r.size,8,1,f);
+		fwrite(&r.frames,4,1,f);
+		fwrite(&r.rate,4,1,f);
+		fwrite(&r.channels,1,1,f);
+		fwrite(&r.bits,1,1,f);
+		fwrite(&r.format,1,1,f);
+		fwrite(&r.peak,2,1,f);
+	}
+	if (fclose(f) == 0) rename(temp2,temp);
+}
+
+// index one directory and everything under it - relpath is relative to filesroot, "" for the root
+// returns true if anything in the index changed
+bool index_scandir(const char *relpath, int depth) {
+	char dirpath[PATHLEN],rel[PATHLEN],full[PATHLEN];
+	struct dirent *dir;
+	struct stat st;
+	bool changed=0;
+
+	if (relpath[0]) snprintf(dirpath,PATHLEN,"%s/%s",filesroot,relpath);
+	else snprintf(dirpath,PATHLEN,"%s",filesroot);
+	DIR *d=opendir(dirpath);
+	if (d == NULL) return 0;
+	while ((dir = readdir(d)) != NULL) {
+		if (dir->d_name[0] == '.') continue;  // skips . .. and hidden files including the index itself
+		if (relpath[0]) snprintf(rel,PATHLEN,"%s/%s",relpath,dir->d_name);
+		else snprintf(rel,PATHLEN,"%s",dir->d_name);
+		snprintf(full,PATHLEN,"%s/%s",filesroot,rel);
+		if (stat(full,&st)) continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (depth < INDEX_MAXDEPTH) changed|=index_scandir(rel,depth+1);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) || !index_wanted(dir->d_name)) continue;
+
+		pthread_mutex_lock(&indexlock);
+		int i=index_find(rel);
+		if ((i >= 0) && (sampleindex[i].mtime == st.st_mtime) && (sampleindex[i].size == st.st_size)) {
+			sampleindex[i].seen=1;  // unchanged
+			pthread_mutex_unlock(&indexlock);
+			continue;
+		}
+		pthread_mutex_unlock(&indexlock);
+
+		indexrecord r;
+		strcpy(r.path,rel);
+		r.mtime=st.st_mtime;
+		r.size=st.st_size;
+		r.seen=1;
+		if (!index_parsefile(full,st.st_size,&r)) printf("sample index: can't read header of %s\n",full);  // keep it so we don't retry every scan
+
+		pthread_mutex_lock(&indexlock);
+		auto it=std::lower_bound(sampleindex.begin(),sampleindex.end(),rel,index_less);
+		if ((it != sampleindex.end()) && !strcmp(it->path,rel)) *it=r;
+		else sampleindex.insert(it,r);
+		pthread_mutex_unlock(&indexlock);
+		changed=1;
+		usleep(1000);  // be nice to the SD card - the UI and sample loads share it
+	}
+	closedir(d);
+	return changed;
+}
+
+// index thread - keeps the index up to date with the library
+void *indexthread(void *threadid) {
+	nice(10);  // well below the UI - this is all background work
+	index_load();
+	while (1) {
+		pthread_mutex_lock(&indexlock);
+		for (auto &r : sampleindex) r.seen=0;
+		pthread_mutex_unlock(&indexlock);
+
+		bool changed=index_scandir("",0);
+
+		pthread_mutex_lock(&indexlock);
+		size_t before=sampleindex.size();
+		sampleindex.erase(std::remove_if(sampleindex.begin(),sampleindex.end(),[](const indexrecord &r) {return !r.seen;}),sampleindex.end());
+		if (sampleindex.size() != before) changed=1;  // files were deleted
+		pthread_mutex_unlock(&indexlock);
+
+		if (changed) index_save();
+		sleep(INDEX_RESCAN);
+	}
+	return 0;  // will never get here
+}
@@ -44,7 +44,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h> 
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include "portaudio.h"
 #include <string.h>
@@ -60,8 +62,17 @@
 #include <asm/ioctls.h>
 #include <chrono>
 #include <unistd.h> // for usleep
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <atomic>
+#include <algorithm>
 #include <libevdev-1.0/libevdev/libevdev.h>
+#include <alsa/asoundlib.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "AudioFile.h"
 #include "ArduiPi_OLED_lib.h"
@@ -123,6 +134,8 @@ s_opts opts = {
 // whats read is the result of the previous conversion ie last time you called it
 // since there is no SPI resource locking you can't call this when the display driver might be running
 
+pthread_mutex_t spilock = PTHREAD_MUTEX_INITIALIZER; // SPI is shared by the OLED and the CV A/D - hold this for any SPI access from a thread
+
 uint16_t LTC1857cmd(uint8_t cmd) {
   char buf[2];
   uint16_t res;
@@ -135,26 +148,87 @@ uint16_t LTC1857cmd(uint8_t cmd) {
 }
 
 float cv[8];  // current CV input readings
+uint16_t cvraw[8];  // raw 12 bit A/D readings from the last scan
+
+// LTC1857 scan engine
+// the old code called LTC1857cmd() 8 times with a 10us delay after each one - well over 100us of busy waiting per scan
+// here the command words are precomputed and the whole scan is clocked straight through the SPI FIFO with CS1 selected once
+// every word still gets its own TA cycle because the LTC1857 starts a conversion on the rising edge of CS
+// instead of a fixed delay we only spin for what is left of the conversion time, timed with the free running system timer
+// bcm2835 lib has no SPI DMA support so this is as close to a single transaction as the A/D allows
+
+#define LTC1857_CONVERSION_US 5 // time to allow for a conversion after CS goes high
+
+uint8_t LTC1857commands[8]; // command byte for each channel - built by LTC1857init()
+int8_t LTC1857last=7;  // channel of the conversion in progress ie what the next read will return
+uint64_t LTC1857ready=0; // system timer value when that conversion will be done
+
+void LTC1857init(void) {
+	for (int ch=0;ch<8;++ch) {
+		uint8_t select=(ch &6) << 3;  // addressing is a bit odd in single ended mode
+		uint8_t odd=(ch &1) <<6;	
+		LTC1857commands[ch]=SINGLE | UNIPOLAR | select | odd;
+	}
+}
+
+// wait for the conversion in progress to finish
+void LTC1857wait(void) {
+	uint64_t now=bcm2835_st_read();
+	if (now == 0) delayMicroseconds(LTC1857_CONVERSION_US);  // no access to the system timer - fall back to a fixed delay
+	else while (now < LTC1857ready) now=bcm2835_st_read();  // spin for the rest of the conversion time, if any
+}
+
+// start a conversion on channel ch and put the result of the previous conversion in *raw
+// returns the channel the result belongs to
+// caller must hold spilock
+
+int LTC1857convert(int ch, uint16_t *raw) {
+	int prev=LTC1857last;
+	LTC1857wait();
+	*raw=LTC1857cmd(LTC1857commands[ch]) >>4;
+	LTC1857last=ch;
+	LTC1857ready=bcm2835_st_read()+LTC1857_CONVERSION_US;
+	return prev;
+}
+
+// scan all 8 channels and return the 12 bit results in raw[]
+// LTC1857 results are pipelined - each word returns the conversion started by the word before it
+// the first word returns whatever channel was converted last, normally channel 7 from the previous scan
+// caller must hold spilock
+
+void LTC1857scan(uint16_t *raw) {
+	volatile uint32_t* paddr = bcm2835_spi0 + BCM2835_SPI0_CS/4;
+	volatile uint32_t* fifo = bcm2835_spi0 + BCM2835_SPI0_FIFO/4;
+	int ch;
+	
+	bcm2835_peri_set_bits(paddr, BCM2835_SPI_CS1, BCM2835_SPI0_CS_CS); // chip Select CS1 for the whole scan
+	for (ch=0;ch<8;++ch) {
+		LTC1857wait();
+		bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_CLEAR, BCM2835_SPI0_CS_CLEAR); // clear TX and RX FIFOs
+		bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_TA, BCM2835_SPI0_CS_TA); // CS low
+		bcm2835_peri_write_nb(fifo, LTC1857commands[ch]);  // command is sent twice - both bytes fit in the FIFO
+		bcm2835_peri_write_nb(fifo, LTC1857commands[ch]);
+		while (!(bcm2835_peri_read_nb(paddr) & BCM2835_SPI0_CS_DONE)) ; // 16 SPI clocks
+		uint16_t res=(uint16_t)(bcm2835_peri_read_nb(fifo) & 0xff)<<8;
+		res|=bcm2835_peri_read_nb(fifo) & 0xff;
+		bcm2835_peri_set_bits(paddr, 0, BCM2835_SPI0_CS_TA); // CS high starts the next conversion
+		LTC1857ready=bcm2835_st_read()+LTC1857_CONVERSION_US;
+		raw[LTC1857last]=res >>4; // result is for the channel we asked for last time
+		LTC1857last=ch;
+	}
+	bcm2835_peri_set_bits(paddr, BCM2835_SPI_CS0, BCM2835_SPI0_CS_CS);  // restore CS0 for OLED driver
+}
 
 // sample CV inputs
 // input range is 0-5v
-// note that LCT1857 reads are delayed by 1 - you get the value from the last channel requested
-// to avoid a redundant read we can assume the first read result is from channel 7 ie last time we called LTC1857cmd
 // do NOT call this in an interrupt because SPI is shared with the OLED
 
 void read_cvs(void) {
 	int ch;
-	uint8_t command;
-	command= SINGLE | UNIPOLAR; // next channel to read is 0
-	cv[7]=(float)(LTC1857cmd(command) >>4)/4096.0; // result from last time we called LTC1857cmd()
-	delayMicroseconds(10);  // wait at least 5us for next conversion
-	for (ch=1;ch<8;++ch) {
-		uint8_t select=(ch &6) << 3;  // addressing is a bit odd in single ended mode
-		uint8_t odd=(ch &1) <<6;	
-		command=SINGLE | UNIPOLAR | select | odd;
-		cv[ch-1]=(float)(LTC1857cmd(command) >>4)/4096.0; // scale to 0-1.0
-		delayMicroseconds(10);  // wait at least 5us for next conversion
-	}
+	pthread_mutex_lock(&spilock);
+	LTC1857scan(cvraw);
+	pthread_mutex_unlock(&spilock);
+	for (ch=0;ch<8;++ch) cv[ch]=(float)cvraw[ch]/4096.0; // scale to 0-1.0
 }
 	
 
@@ -162,9 +236,11 @@ void read_cvs(void) {
 //
 	
 #define NUMSAMPLES 8
+#define PATHLEN 256  // max length of file paths
 #define NUM_SECONDS   (60)
 #define SAMPLE_RATE   (44100)
-#define FRAMES_PER_BUFFER  (64)
+#define MAXFRAMES  (1024)  // largest block the renderer handles in one go - bigger callbacks are split up
+#define OUT_MAXCHANNELS 8  // most output channels we drive - each slot goes to one pair of them
 
 #ifndef M_PI
 #define M_PI  (3.14159265)
@@ -172,10 +248,22 @@ void read_cvs(void) {
 
 AudioFile<double> audioFile[NUMSAMPLES];
 
+char *filesroot="./samples";  // root of file tree
+int outchannels=2;  // output channels the stream was opened with - the -o option. channel 0 is the right of the first pair
+enum outformats {OUTAUTO,OUTFLOAT,OUTS16,OUTS24,OUTS32};  // output sample formats - the -f option. 24 bit is in a 32 bit word
+char *textformats[]={"auto","float","s16","s24","s32"};  // must match the enum
+int outformat=OUTAUTO;  // the backend sets it to what the device was opened with
+int outbytes=4;         // bytes per output sample
+
 enum playmode {TRIGGERED,LOOPED,GATED};  // playback modes
-enum playstate {SILENT,PLAYING,SUSPENDED};  // playback states
+enum playstate {SILENT,PLAYING,SUSPENDED,RELEASING};  // playback states - RELEASING is playing out after a sustain loop
 enum midimode {OFF,PERCUSSION,PITCHED};  // MIDI playback modes
 enum modtargets {NOTHING,LEVEL,PAN,SPEED,PITCH};  // enum index must match the text in the menus
+enum fastcvmodes {FASTFM,SCRUB};  // audio rate CV modes - enum index must match the text in the menus
+enum scales {QOFF,QCHROMATIC,QMAJOR,QMINOR,QCUSTOM};  // pitch quantizer scales - enum index must match the text in the menus
+enum slicemodes {SLICEOFF,SLICESTEP,SLICENOTE,SLICECV};  // how triggers pick slices - enum index must match the text in the menus
+enum voicetypes {VOICESAMPLE,VOICESTRETCH,VOICEGRAINS};  // playback engines - enum index must match the text in the menus
+enum filtermodes {FILTEROFF,FILTERLP,FILTERHP,FILTERBP};  // voice filter - enum index must match the text in the menus
 
 // sample info structure - one per sample
 // note that the menu system only deals with int16 types so some values have to be converted to float
@@ -184,7 +272,7 @@ enum modtargets {NOTHING,LEVEL,PAN,SPEED,PITCH};  // enum index must match the t
 
 typedef struct
  {
-    char filename[80];  // filename
+    char filename[PATHLEN];  // filename relative to filesroot
 	double phaseinc; // for normal speed playback advance phasor 1 sample per call to nextsample ie. phaseinc = 1.0/audioFile[i].getNumSamplesPerChannel()
 	double phasor;    // current phase (playback pointer) range 0-1.0
 	double pitch;    // pitch calculated from CV input
@@ -202,6 +290,33 @@ typedef struct
 	int16_t panCV;      // pan CV 
 	int16_t speedCV;		// speed CV 
 	int16_t pitchCV; 		// pitch CV modulator
+	int16_t fastCV;		// audio rate CV channel for FM or scrubbing
+	int16_t fastmode;		// what the audio rate CV does
+	int16_t fmdepth;		// FM depth 0-1000 converts to 0-1.0
+	int16_t quantize;		// pitch CV quantizer scale
+	int16_t start;		// start point 0-1000 converts to 0-1.0 of the sample
+	int16_t syncbeats;		// looped slots play over this many MIDI clock beats, 0=off
+	int16_t loopstart;		// sustain loop start 0-1000 of the sample, if both are 0 the loop in the file is used
+	int16_t loopend;		// sustain loop end 0-1000
+	int16_t slicemode;		// how a trigger picks a slice of the sample, SLICEOFF plays the whole thing
+	int16_t sliceCV;		// CV channel that picks the slice in SLICECV mode
+	int16_t voice;		// how the sample is played - VOICESTRETCH and VOICEGRAINS keep speed and pitch apart
+	int16_t grainpos;		// granular voice - grain position 0-1000 of the sample, ahead of the playhead
+	int16_t grainposCV;		// CV channel for grain position
+	int16_t density;		// grains per second
+	int16_t densityCV;		// CV channel for density
+	int16_t grainsize;		// grain length in ms
+	int16_t grainsizeCV;		// CV channel for grain size
+	int16_t spray;		// random offset of each grain's position up to this many ms
+	int16_t sprayCV;		// CV channel for spray
+	int16_t filter;		// filter mode
+	int16_t cutoff;		// filter cutoff 0-1000, exponential 20Hz-20kHz
+	int16_t cutoffCV;		// CV channel for cutoff
+	int16_t resonance;		// filter resonance 0-1000
+	int16_t resonanceCV;		// CV channel for resonance
+	int16_t delaysend;		// send to the delay 0-1000, after level and pan
+	int16_t reverbsend;		// send to the reverb 0-1000
+	int16_t output;		// output channel pair 0 to OUT_MAXCHANNELS/2-1
 }
 sampleinfo;
 
@@ -225,6 +340,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp2.wav", // sample name
 0.0,			// phaseinc
@@ -244,6 +386,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp3.wav", // sample name
 0.0,			// phaseinc
@@ -263,6 +432,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp4.wav", // sample name
 0.0,			// phaseinc
@@ -282,6 +478,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp5.wav", // sample name
 0.0,			// phaseinc
@@ -301,6 +524,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp6.wav", // sample name
 0.0,			// phaseinc
@@ -320,6 +570,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp7.wav", // sample name
 0.0,			// phaseinc
@@ -339,6 +616,33 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 
 "default/samp8.wav", // sample name
 0.0,			// phaseinc
@@ -358,8 +662,50 @@ SILENT,			// playing state
 0,			 	// pan CV channel 0=none, 1= cv[0] etc
 0, 				//  speed CV channel
 0,			 	// pitch CV channel
+0,			 	// audio rate CV channel 0=none
+FASTFM,			// audio rate CV mode
+500,			// FM depth
+QOFF,			// pitch CV quantizer
+0,				// start point
+0,				// sync beats 0=off
+0,				// loop start - loop points 0 = use the ones in the file
+0,				// loop end
+SLICEOFF,		// slice mode
+0,				// slice CV channel
+VOICESAMPLE,	// voice type
+0,				// grain position
+0,				// grain position CV channel
+20,				// grains per second
+0,				// density CV channel
+100,			// grain size in ms
+0,				// grain size CV channel
+0,				// spray in ms
+0,				// spray CV channel
+FILTEROFF,		// filter mode
+1000,			// cutoff
+0,				// cutoff CV channel
+0,				// resonance
+0,				// resonance CV channel
+0,				// delay send
+0,				// reverb send
+0,				// output pair - 0 is outputs 1 and 2
 };
 
+#include "fastcv.h"  // audio rate CV - needs samp[]
+#include "pitchcv.h"  // calibrated pitch CV
+#include "slices.h"  // transient detection and slice playback
+#include "midimap.h"  // MIDI controller routing
+#include "midiclock.h"  // MIDI clock tempo sync
+#include "loops.h"  // sustain loops
+#include "stretch.h"  // time stretch voices
+#include "grains.h"  // granular voices
+#include "filter.h"  // voice filters
+#include "fx.h"  // send effects
+#include "convolve.h"  // convolution reverb
+#include "master.h"  // output limiter and soft clipper
+#include "kits.h"  // kit presets and background kit loading - the loader does the reverb IRs too
+#include "latency.h"  // output buffer auto tuning
+
 // get next sample for right channel - actually I think I may have left and right swapped
 // does interpolation for fractional rates
 
@@ -372,12 +718,9 @@ float nextsampleR(int s) {
 	intPart=(int32_t)temp;
 	
     double fracPart = temp - (double)intPart;
-    double samp0 =audioFile[s].samples[0][intPart];
-	if (samp[s].phaseinc < 0) { // are we playing sample in reverse?
-		if (--intPart < 0) intPart=samplesize-1; // handle wraparound
-	}
-    else if (++intPart >= samplesize) intPart = 0; // playing forwards - handle wraparound 
-    double samp1 = audioFile[s].samples[0][intPart];
+    double samp0 =loopfetch(s,0,intPart);
+	intPart=loopnext(s,intPart,samplesize);  // next one in the direction we're playing - round the loop if we're sustaining
+    double samp1 = loopfetch(s,0,intPart);
 /*
 	// update phasor is done when you call nextsampleL()
 */
@@ -386,47 +729,75 @@ float nextsampleR(int s) {
 	else return (float)(samp1 + (samp0 - samp1) * fracPart); // phasor is going in reverse
 }
 
-// get next sample for left channel
-// does interpolation for fractional rates
 // calculates pitch based on speed, MIDI note, transpose etc
-// same code as above but we update phasinc and phasor here because it only needs to be done once per stereo pair of samples
-// we also handle sample start/stop here since we know when it wraps around to play again
+// none of these change faster than once per block so this is called once per block by the renderer
+// stretch and granular voices keep them apart - phaseinc is just the speed and the pitch ratio goes in pitchratio[]
 
-float nextsampleL(int s) {
+void updatephaseinc(int s, bool separate) {
 	int32_t samplesize=audioFile[s].getNumSamplesPerChannel();
-	int32_t intPart;
 	double inc;
 	
-// calculate the pitch of the sample - we only need to do this for one channel so do it here
 	if (samplesize <= 0) samplesize=1; // to avoid division by zero below
-	inc=((float)samp[s].speed/1000)/samplesize;  // if speed=1.0 we advance 1 sample per step
-	inc=inc*samp[s].pitch;			// adjust pitch
+	inc=((float)samp[s].speed/1000+mapvalue[s][MAP_SPEED])/samplesize;  // if speed=1.0 we advance 1 sample per step
+	float ratio=samp[s].pitch;			// adjust pitch
 	
 	int16_t noteoffset = samp[s].midinote-samp[s].note+samp[s].transpose; // calculate MIDI pitch relative to the actual pitch of the sample
-    inc=inc*powf(2.0, noteoffset / 12.0);
-	samp[s].phaseinc=inc;
+    ratio=ratio*exp2lut(noteoffset / 12.0 + mapvalue[s][MAP_PITCH]);  // MIDI pitch modulation is in octaves
+	float sync=syncinc[s];
+	if (sync > 0) {  // locked to MIDI clock - tempo sets the rate, speed just sets direction
+		inc=(samp[s].speed >= 0) ? sync : -sync;
+		if (!separate) ratio=1.0;  // can't change pitch without changing the rate
+	}
+	if (separate) {
+		samp[s].phaseinc=inc;
+		pitchratio[s]=ratio;
+	}
+	else samp[s].phaseinc=inc*ratio;
+}
+
+// get next sample for left channel
+// does interpolation for fractional rates
+// same code as above but we update the phasor here because it only needs to be done once per stereo pair of samples
+// we also handle sample start/stop here since we know when it wraps around to play again
+
+float nextsampleL(int s) {
+	int32_t samplesize=audioFile[s].getNumSamplesPerChannel();
+	int32_t intPart;
 	
     // do linear interpolation between samples to pitch up and down
     double temp = samp[s].phasor * (samplesize); // index into the sample array using phasor 0-1.0
 	intPart=(int32_t)temp;
 	
     double fracPart = temp - (double)intPart;
-    double samp0 =audioFile[s].samples[audioFile[s].getNumChannels()-1][intPart]; // (getnumchannels() -1) should be 1 for stereo and 0 for mono
-	if (samp[s].phaseinc < 0) { // are we playing sample in reverse?
-		if (--intPart < 0) intPart=samplesize-1; // handle wraparound
-	}
-    else if (++intPart >= samplesize) intPart = 0; // playing forwards - handle wraparound 
-    double samp1 = audioFile[s].samples[audioFile[s].getNumChannels()-1][intPart];
+	int ch=audioFile[s].getNumChannels()-1;  // should be 1 for stereo and 0 for mono
+    double samp0 =loopfetch(s,ch,intPart);
+	intPart=loopnext(s,intPart,samplesize);  // next one in the direction we're playing - round the loop if we're sustaining
+    double samp1 = loopfetch(s,ch,intPart);
 
 	// update phase and handle play modes
+	double last=samp[s].phasor;
     samp[s].phasor += samp[s].phaseinc; 
+	if (loops[s].active) {  // sustaining - go round the loop when we cross either end of it
+		double pos=samp[s].phasor*samplesize;
+		if ((samp[s].phaseinc > 0) && (pos >= loops[s].end) && (last*samplesize < loops[s].end)) samp[s].phasor-=loops[s].plen;
+		if ((samp[s].phaseinc < 0) && (pos < loops[s].start) && (last*samplesize >= loops[s].start)) samp[s].phasor+=loops[s].plen;
+	}
     if (samp[s].phasor> 1.0) {
 		samp[s].phasor-=1.0; // case of playing forward
 		if (samp[s].mode == TRIGGERED) samp[s].state=SILENT; // in triggered mode we just play once
+		if (samp[s].state == RELEASING) samp[s].state=SILENT; // played out the tail of a looped sample
 	}
 	if (samp[s].phasor < 0) {
 		samp[s].phasor+=1.0; // case of playing reverse
 		if (samp[s].mode == TRIGGERED) samp[s].state=SILENT; // in triggered mode we just play once
+		if (samp[s].state == RELEASING) samp[s].state=SILENT;
+	}
+	if (sliceplay[s].on) {  // a slice stops at its end
+		double pos=samp[s].phasor*samplesize;
+		if ((pos >= sliceplay[s].hi) || (pos < sliceplay[s].lo)) {  // either way - playing backwards or wrapped round
+			samp[s].state=SILENT;
+			sliceplay[s].on=0;
+		}
 	}
 
 	if (samp[s].state == SILENT) return 0;  // mute audio if not playing
@@ -435,32 +806,206 @@ float nextsampleL(int s) {
 }
 
 
-/* This routine will be called by the PortAudio engine when audio is needed.
-** It may called at interrupt level on some machines so don't do anything
-** that could mess up the system like calling malloc() or free().
-*/
-// RH we sample the trigger inputs here and do the trigger logic since its called every few ms
-// it appears that this routine is called in bursts to fill a larger buffer - result is it can miss triggers
-// I added a short sleep delay to spread out the GPIO sampling interval
-// with the delay spreading the sampling out over time it seems to catch all the trigger inputs (which have been stretched in HW to about 40ms minimum)
-// there will still be some trigger to sample output jitter however - lets call it humanizing :)
-// tried using gpio-button device tree overlay for triggers but it loses events - not enough priority for the event reader thread?
+// render a block of one sample slot into outL and outR
+// mod points to the slot's audio rate CV upsampled to the engine rate, or NULL if it doesn't use one
+// modulation is turned into a per sample phase increment first in simple loops the compiler can vectorize
+// then the interpolator runs with that increment
 
-static int patestCallback( const void *inputBuffer, void *outputBuffer,
-                            unsigned long framesPerBuffer,
-                            const PaStreamCallbackTimeInfo* timeInfo,
-                            PaStreamCallbackFlags statusFlags,
-                            void *userData )
-{
-    //paTestData *data = (paTestData*)userData;
-    float *out = (float*)outputBuffer;
-    uint16_t i,s;
+void renderslot(int s, float *outL, float *outR, unsigned long frames, const float *mod) {
+	float inc[MAXFRAMES];
+	unsigned long i;
 
+	bool stretching=stretch_claim(s);
+	bool granular=(samp[s].voice == VOICEGRAINS);
+	updatephaseinc(s,stretching || granular);
+	loop_update(s);
+	loops[s].active=loops[s].valid && !stretching && !granular && !sliceplay[s].on && (samp[s].state == PLAYING) && ((samp[s].mode == GATED) || (samp[s].midimode == PITCHED));
+	if (stretching) {  // speed and pitch are separate - audio rate CV doesn't apply
+		stretch_render(s,outL,outR,frames);
+		return;
+	}
+	if (granular) {
+		grain_render(s,outL,outR,frames);
+		return;
+	}
+	if (mod == NULL) {  // normal playback
+		for (i=0;i<frames;++i) {
+			outR[i]=nextsampleR(s);
+			outL[i]=nextsampleL(s);  // MUST call nextsampleL() to update the sample phasor
+		}
+		return;
+	}
 
-    (void) timeInfo; /* Prevent unused variable warnings. */
-    (void) statusFlags;
-    (void) inputBuffer;
+	double base=samp[s].phaseinc;
+	if (samp[s].fastmode == FASTFM) {  // linear through zero FM - increment can go negative and play backwards
+		float index=(float)samp[s].fmdepth/1000*FM_MAXINDEX;
+		float fbase=(float)base;
+		for (i=0;i<frames;++i) inc[i]=fbase*(1.0f+index*(mod[i]*2.0f-1.0f));  // CV 0-1.0 to bipolar
+	}
+	else {  // scrub - CV is the playhead position, increment is just the distance to the next position
+		inc[0]=mod[0]-(float)samp[s].phasor;
+		for (i=1;i<frames;++i) inc[i]=mod[i]-mod[i-1];
+	}
+	for (i=0;i<frames;++i) {
+		samp[s].phaseinc=inc[i];
+		outR[i]=nextsampleR(s);
+		outL[i]=nextsampleL(s);
+	}
+	samp[s].phaseinc=base;
+}
+
+float voiceL[NUMSAMPLES][MAXFRAMES];  // per slot render buffers
+float voiceR[NUMSAMPLES][MAXFRAMES];
+float mixbuf[MAXFRAMES*OUT_MAXCHANNELS];  // float mix when the output is integer
+
+// mix the slots straight into the interleaved output, each into its own channel pair, and build the effects sends
+// one of these for each channel count so the frame stride is a constant
+template <int NCH>
+void mixslots(float *out, fxsendframe *send, const int *active, int numactive, const float *levelL, const float *levelR,
+		const float *delaysend, const float *reverbsend, unsigned long frames) {
+	unsigned long i;
+	memset(out,0,frames*NCH*sizeof(float));
+	memset(send,0,frames*sizeof(fxsendframe));
+	for (int v=0; v< numactive;++v) {
+		int s=active[v];
+		int pair=samp[s].output;
+		if (pair >= NCH/2) pair=0;  // device doesn't have that pair - use the main outputs
+		float *o=out+pair*2;
+		const float *vr=voiceR[s],*vl=voiceL[s];
+		float gr=levelR[s],gl=levelL[s];
+		for (i=0;i<frames;++i) {
+			o[i*NCH]+=vr[i]*gr;
+			o[i*NCH+1]+=vl[i]*gl;
+		}
+		float ds=delaysend[s],rs=reverbsend[s];
+		if ((ds == 0) && (rs == 0)) continue;
+		for (i=0;i<frames;++i) {
+			float r=vr[i]*gr;
+			float l=vl[i]*gl;
+			send[i].delayR+=r*ds;
+			send[i].delayL+=l*ds;
+			send[i].reverbR+=r*rs;
+			send[i].reverbL+=l*rs;
+		}
+	}
+}
+
+// render one block of up to MAXFRAMES frames of outchannels channels into out, in the output format
+// control rate stuff is done once per block, then each slot is rendered into its own buffer and mixed
+// float output is mixed in place, integer output is mixed in mixbuf and the master pass writes it into out
+
+void renderblock(void *out, unsigned long frames) {
+	float levelL[NUMSAMPLES],levelR[NUMSAMPLES];
+	float delaysend[NUMSAMPLES],reverbsend[NUMSAMPLES];
+	fxsendframe send[MAXFRAMES];
+	float *mix=(outformat == OUTFLOAT) ? (float *)out : mixbuf;
+	int active[NUMSAMPLES];
+	int numactive=0;
+	unsigned long i;
+	int s;
+
+// process play modes and CV modulators
+	for (i=0; i< NUMSAMPLES;++i) {
+//		if (samp[i].midimode) samp[i].pitch =1.0; // kind of hokey - reset midi note or pitch depending on midi mode
+//		else samp[i].midinote=60;        // this is to avoid midi notes missing up pitch and vice versa
+		
+		if (samp[i].state != SUSPENDED) { // don't change anything if suspended
+			int16_t req=slicereq[i].exchange(0);  // MIDI note on
+			if (req == SLICE_TRIG+2) {
+				if (!slice_trigger(i,SLICE_TRIG)) samp[i].phasor=startpos(i); // start point - from the end if playing backwards
+				samp[i].state=PLAYING;
+			}
+			else if ((req >= 2) && slice_trigger(i,req-2)) {  // Note mode slice - ignored if there's no slice for the note
+				samp[i].midinote=samp[i].note;
+				samp[i].state=PLAYING;
+			}
+			switch (samp[i].mode) {
+				case TRIGGERED:
+				case GATED:
+					if (trigcnt[i] == TRIG_DEBOUNCE) {  // start sample playing if we have a rising debounced trigger edge
+						if (!slice_trigger(i,SLICE_TRIG)) samp[i].phasor=startpos(i); // start point - from the end if playing backwards
+						samp[i].state=PLAYING;
+					}
+					if ((samp[i].mode == GATED) && (trigcnt[i] == 0) && (samp[i].state == PLAYING)) samp[i].state=releasestate(i); // looped samples play out their tail
+					break;
+				case LOOPED:
+					if (syncrestart[i].exchange(false)) samp[i].phasor=startpos(i); // back in phase with the MIDI clock
+					samp[i].state=PLAYING; // force playing mode
+					sliceplay[i].on=0;  // loops play the whole sample
+					break;
+				default:
+					break;
+			}
+			if (samp[i].levelCV!=0) samp[i].level=(int16_t)(cv[samp[i].levelCV-1]*1000);  // process CV modulators
+			if (samp[i].panCV!=0) samp[i].pan=(int16_t)((cv[samp[i].panCV-1]-0.5)*2000); // convert normalized CV to integer range used in menus
+			if (samp[i].speedCV!=0) samp[i].speed=(int16_t)((cv[samp[i].speedCV-1]-0.5)*4000); // convert normalized CV to integer range used in menus
+			if (samp[i].pitchCV!=0) samp[i].pitch=pitchcv(samp[i].pitchCV-1,samp[i].quantize); // calibrated 1V/octave, 3.0 v = nominal pitch
+			if (samp[i].grainposCV!=0) samp[i].grainpos=(int16_t)(cv[samp[i].grainposCV-1]*1000);  // granular voice controls
+			if (samp[i].densityCV!=0) samp[i].density=(int16_t)(1+cv[samp[i].densityCV-1]*(GRAIN_MAXDENSITY-1));
+			if (samp[i].grainsizeCV!=0) samp[i].grainsize=(int16_t)(GRAIN_MINSIZE+cv[samp[i].grainsizeCV-1]*(GRAIN_MAXSIZE-GRAIN_MINSIZE));
+			if (samp[i].sprayCV!=0) samp[i].spray=(int16_t)(cv[samp[i].sprayCV-1]*GRAIN_MAXSPRAY);
+			if (samp[i].cutoffCV!=0) samp[i].cutoff=(int16_t)(cv[samp[i].cutoffCV-1]*1000);
+			if (samp[i].resonanceCV!=0) samp[i].resonance=(int16_t)(cv[samp[i].resonanceCV-1]*1000);
+		}
+	}
+	
+	fastcv_upsample(frames);  // bring the audio rate CV channels up to the engine rate
+	stretch_begin(frames);
+	grain_begin();
+	midimap_update(frames);   // MIDI controller changes
+
+	for (s=0; s< NUMSAMPLES;++s) {  // render all the samples
+		if (samp[s].state !=SUSPENDED) {  // so we don't access during file loading
+			float level=(float)samp[s].level/1000*mapvalue[s][MAP_LEVEL];
+			float pan=(float)samp[s].pan/1000+mapvalue[s][MAP_PAN];
+			if (pan > 1.0) pan=1.0;
+			if (pan < -1.0) pan=-1.0;
+			levelR[s]=level*(pan/2+0.5); 
+			levelL[s]=level*(1.0-(pan/2+0.5));
+			delaysend[s]=(float)samp[s].delaysend/1000;
+			reverbsend[s]=(float)samp[s].reverbsend/1000;
+			renderslot(s,voiceL[s],voiceR[s],frames,fastcv_lookup(samp[s].fastCV));
+			filter_update(s,voiceL[s],voiceR[s]);
+			active[numactive++]=s;
+		}
+		else filter_update(s,NULL,NULL);
+	}
+	filter_process(frames);
+	
+	switch (outchannels) {  // sum up all the samples and the effects sends
+		case 2: mixslots<2>(mix,send,active,numactive,levelL,levelR,delaysend,reverbsend,frames); break;
+		case 4: mixslots<4>(mix,send,active,numactive,levelL,levelR,delaysend,reverbsend,frames); break;
+		case 6: mixslots<6>(mix,send,active,numactive,levelL,levelR,delaysend,reverbsend,frames); break;
+		default: mixslots<8>(mix,send,active,numactive,levelL,levelR,delaysend,reverbsend,frames); break;
+	}
+	conv_block(mix,send,frames);  // IR reverb takes the reverb sends if it's on
+	fx_block(mix,send,frames);  // effects from last block in, this block's sends out
+	master_process(mix,out,frames);  // keep it out of the DAC's hard clipping and into the output format
+}
+
+// output timing for the status menu - so the PortAudio and ALSA backends can be compared
+float outlatencyus;  // how far ahead of the DAC we render - from the backend
+float outjitterus;   // worst recent difference between the time between buffers and what it should be
+
+// call once per buffer the backend asks for
+void audio_timing(unsigned long frames) {
+	static struct timespec last={0,0};
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	if (last.tv_sec != 0) {
+		float us=(now.tv_sec-last.tv_sec)*1e6f+(now.tv_nsec-last.tv_nsec)/1000.0f;
+		float dev=fabsf(us-(float)frames*1000000/SAMPLE_RATE);
+		if (dev > outjitterus) outjitterus=dev;  // peak hold that dies away over a few seconds
+		else outjitterus*=0.999f;
+	}
+	last=now;
+}
+
+// everything the audio callback does - PortAudio calls it from patestCallback, the ALSA backend from its own thread
+// out is framesPerBuffer frames of outchannels interleaved samples in the output format
 
+void audio_render(void *out, unsigned long framesPerBuffer)
+{
 // sample the GPIO inputs here - MUCH simpler than using libevdev and button device tree overlays and probably less latency
 	if (!bcm2835_gpio_lev(PINBUTTON)) {   // process encoder button input
 		++ buttoncnt;
@@ -501,50 +1046,47 @@ static int patestCallback( const void *inputBuffer, void *outputBuffer,
 	}
 */
 
-// process play modes and CV modulators
-	for (i=0; i< NUMSAMPLES;++i) {
-//		if (samp[i].midimode) samp[i].pitch =1.0; // kind of hokey - reset midi note or pitch depending on midi mode
-//		else samp[i].midinote=60;        // this is to avoid midi notes missing up pitch and vice versa
-		
-		if (samp[i].state != SUSPENDED) { // don't change anything if suspended
-			switch (samp[i].mode) {
-				case TRIGGERED:
-				case GATED:
-					if (trigcnt[i] == TRIG_DEBOUNCE) {  // start sample playing if we have a rising debounced trigger edge
-						if (samp[i].speed >= 0) samp[i].phasor=0.0; // case of playing forwards
-						else samp[i].phasor=1.0; // case of playing backwards	
-						samp[i].state=PLAYING;
-					}
-					if ((samp[i].mode == GATED) && (trigcnt[i] == 0)) samp[i].state=SILENT; 
-					break;
-				case LOOPED:
-					samp[i].state=PLAYING; // force playing mode
-					break;
-				default:
-					break;
-			}
-			if (samp[i].levelCV!=0) samp[i].level=(int16_t)(cv[samp[i].levelCV-1]*1000);  // process CV modulators
-			if (samp[i].panCV!=0) samp[i].pan=(int16_t)((cv[samp[i].panCV-1]-0.5)*2000); // convert normalized CV to integer range used in menus
-			if (samp[i].speedCV!=0) samp[i].speed=(int16_t)((cv[samp[i].speedCV-1]-0.5)*4000); // convert normalized CV to integer range used in menus
-			if (samp[i].pitchCV!=0) samp[i].pitch=powf(2.0, cv[samp[i].pitchCV-1]*5-3); // CV range is 0-5v so 5 octaves, 3.0 v = nominal pitch
-		}
+	kit_swap();  // switch to a new kit if one has finished loading
+
+	while (framesPerBuffer) {  // render in chunks no bigger than our buffers
+		unsigned long frames=framesPerBuffer;
+		if (frames > MAXFRAMES) frames=MAXFRAMES;
+		renderblock(out,frames);
+		out=(char *)out+frames*outchannels*outbytes;
+		framesPerBuffer-=frames;
 	}
-	
-    for( i=0; i<framesPerBuffer; i++ )
-    {
-		float ch0=0;
-		float ch1=0;
-		for (s=0; s< NUMSAMPLES;++s) {  // sum up all the samples
-			if (samp[s].state !=SUSPENDED) {  // so we don't access during file loading
-				float levelR=(float)samp[s].level/1000*((float)samp[s].pan/2000+0.5); 
-				float levelL=(float)samp[s].level/1000*(1.0-((float)samp[s].pan/2000+0.5));
-				ch0+=nextsampleR(s) * levelR;
-				ch1+=nextsampleL(s) * levelL;  // MUST call nextsampleL() to update the sample phasor
-			}
-		}
-		*out++=ch0;
-		*out++=ch1;
-    }
+}
+
+/* This routine will be called by the PortAudio engine when audio is needed.
+** It may called at interrupt level on some machines so don't do anything
+** that could mess up the system like calling malloc() or free().
+*/
+// RH we sample the trigger inputs here and do the trigger logic since its called every few ms
+// it appears that this routine is called in bursts to fill a larger buffer - result is it can miss triggers
+// I added a short sleep delay to spread out the GPIO sampling interval
+// with the delay spreading the sampling out over time it seems to catch all the trigger inputs (which have been stretched in HW to about 40ms minimum)
+// there will still be some trigger to sample output jitter however - lets call it humanizing :)
+// tried using gpio-button device tree overlay for triggers but it loses events - not enough priority for the event reader thread?
+
+static int patestCallback( const void *inputBuffer, void *outputBuffer,
+                            unsigned long framesPerBuffer,
+                            const PaStreamCallbackTimeInfo* timeInfo,
+                            PaStreamCallbackFlags statusFlags,
+                            void *userData )
+{
+    //paTestData *data = (paTestData*)userData;
+    void *out = outputBuffer;
+
+
+    (void) timeInfo; /* Prevent unused variable warnings. */
+    (void) inputBuffer;
+
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	if (statusFlags & paOutputUnderflow) ++xruns;  // for the latency tuning
+	audio_timing(framesPerBuffer);
+	audio_render(out,framesPerBuffer);
+	latency_load_measure(&t0,framesPerBuffer);
 	
     return paContinue;
 }
@@ -595,6 +1137,9 @@ void *enc(void *threadid) {
 }
 
 
+#include "oledpages.h"  // OLED driver and display thread
+#include "sampleindex.h"  // sample library metadata
+#include "filebrowser.h"  // sample library browser
 #include "menusystem.h"  // here to avoid forward references
 
 // UI thread
@@ -609,11 +1154,63 @@ void *menu(void *threadid) {
 }
 
 // serial midi stuff - here to avoid forward references
+#include "alsaout.h"  // native ALSA output
 #include "midi.h"
+#include "midiin.h"  // MIDI input ports
 
 /*******************************************************************/
-int main(void);
-int main(void)
+// find a PortAudio output device by number or by part of its name - eg "null" or "Loopback" for testing without a DAC
+PaDeviceIndex pa_finddevice(const char *name) {
+	char *end;
+	long n=strtol(name,&end,10);
+	if ((*end == 0) && (n >= 0) && (n < Pa_GetDeviceCount())) return (PaDeviceIndex)n;
+	for (PaDeviceIndex d=0;d<Pa_GetDeviceCount();++d) {
+		const PaDeviceInfo *info=Pa_GetDeviceInfo(d);
+		if ((info->maxOutputChannels > 0) && (strstr(info->name,name) != NULL)) return d;
+	}
+	fprintf(stderr,"no output device %s, there is:\n",name);
+	for (PaDeviceIndex d=0;d<Pa_GetDeviceCount();++d) {
+		const PaDeviceInfo *info=Pa_GetDeviceInfo(d);
+		if (info->maxOutputChannels > 0) fprintf(stderr,"  %d %s (%d channels)\n",d,info->name,info->maxOutputChannels);
+	}
+	return paNoDevice;
+}
+
+// open and start the PortAudio stream with the buffer from the current latency step
+PaError pa_start(PaStream **stream, PaStreamParameters *outputParameters) {
+	PaError err;
+	const latencysetting *l=&latencysteps[latencystep];
+	outputParameters->suggestedLatency=(double)l->period*l->periods/SAMPLE_RATE;
+	err=Pa_OpenStream(
+		stream,
+		NULL, /* no input */
+		outputParameters,
+		SAMPLE_RATE,
+		l->period,
+		paClipOff,      /* master_process() keeps the output in range so don't bother clipping it */
+		patestCallback,
+		NULL );
+	if (err != paNoError) return err;
+	err=Pa_SetStreamFinishedCallback( *stream, &StreamFinished );
+	if (err == paNoError) err=Pa_StartStream( *stream );
+	if (err != paNoError) {  // don't leave it open so the caller can try another step
+		Pa_CloseStream( *stream );
+		return err;
+	}
+	outlatencyus=Pa_GetStreamInfo( *stream )->outputLatency*1000000;
+	printf("PortAudio %d frame buffers, output latency %.0f us\n",l->period,outlatencyus);
+	return paNoError;
+}
+
+// change the PortAudio buffer - the stream is stopped rather than aborted so what's queued plays out
+PaError pa_restart(PaStream **stream, PaStreamParameters *outputParameters) {
+	Pa_StopStream( *stream );
+	Pa_CloseStream( *stream );
+	return pa_start(stream,outputParameters);
+}
+
+int main(int argc, char *argv[]);
+int main(int argc, char *argv[])
 {
     PaStreamParameters outputParameters;
     PaStream *stream;
@@ -623,9 +1220,68 @@ int main(void)
 	int encfd {0};
 	int trigfd[8];
  	int rc = 1;
-	pthread_t enc_thread,trig0_thread,menu_thread,midi_thread;
+	pthread_t enc_thread,trig0_thread,menu_thread,midi_thread,fastcv_thread,display_thread,index_thread,kit_thread,fx_thread,conv_thread,alsa_thread;
+	char *midinames[MIDI_MAXINPUTS];
+	int nummidinames=0;
+	char *devicename=NULL;
+	char *alsadevice=NULL;
+	int opt;
+	int period=0,periods=2;
+	int applied;  // latency step the audio is running with
+
+	latency_load();  // buffer setting from last time
+
+// command line options
+	while ((opt = getopt(argc, argv, "m:o:f:D:a:p:n:")) != -1) {
+		switch (opt) {
+			case 'm':  // MIDI input - serial device path or ALSA rawmidi name, can be given more than once
+				if (nummidinames < MIDI_MAXINPUTS) midinames[nummidinames++]=optarg;
+				break;
+			case 'o':  // number of output channels
+				outchannels=atoi(optarg);
+				if ((outchannels < 2) || (outchannels > OUT_MAXCHANNELS) || (outchannels & 1)) {
+					fprintf(stderr,"-o needs an even number of channels from 2 to %d\n",OUT_MAXCHANNELS);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':  // output sample format
+				for (outformat=OUTS32;outformat >= OUTAUTO;--outformat) if (strcmp(optarg,textformats[outformat]) == 0) break;
+				if (outformat < OUTAUTO) {
+					fprintf(stderr,"-f needs auto, float, s16, s24 or s32\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'D':  // audio output device
+				devicename=optarg;
+				break;
+			case 'a':  // ALSA device - use the native ALSA backend instead of PortAudio
+				alsadevice=optarg;
+				break;
+			case 'p':  // period size - turns off the latency tuning
+				period=atoi(optarg);
+				break;
+			case 'n':  // number of periods
+				periods=atoi(optarg);
+				break;
+			default:
+				fprintf(stderr,"usage: %s [-m midi-device]... [-o channels] [-f format] [-D audio-device | -a alsa-device] [-p period] [-n periods]\n",argv[0]);
+				fprintf(stderr,"  -m /dev/ttyAMA0  serial MIDI (default)\n");
+				fprintf(stderr,"  -m hw:1,0        ALSA rawmidi port eg USB MIDI\n");
+				fprintf(stderr,"  -o 8             output channels - slots can be routed to any pair (default 2)\n");
+				fprintf(stderr,"  -f s24           output format float, s16, s24 or s32 - the renderer writes it directly (default float, or the best the -a device takes)\n");
+				fprintf(stderr,"  -D null          audio device number or part of its name (default is the default device)\n");
+				fprintf(stderr,"  -a hw:0,0        ALSA device - renders straight into its buffer, no PortAudio\n");
+				fprintf(stderr,"  -p 64            period size in frames - fixes the buffer, default is to tune it automatically\n");
+				fprintf(stderr,"  -n 2             periods in the buffer (default 2)\n");
+				exit(EXIT_FAILURE);
+		}
+	}
 	
-    printf("PortAudio sampleplayer test = %d, BufSize = %d\n", SAMPLE_RATE, FRAMES_PER_BUFFER);
+	if (period > 0) {  // buffer given on the command line - use the nearest step and leave it there
+		latencystep=latency_find(period,periods);
+		latencyauto=0;
+	}
+    printf("PortAudio sampleplayer test = %d, BufSize = %d\n", SAMPLE_RATE, latencysteps[latencystep].period);
 
 // start up the GPIO library	
 	if (!bcm2835_init()) {
@@ -654,6 +1310,19 @@ int main(void)
     bcm2835_gpio_set_pud(TRIG7, BCM2835_GPIO_PUD_UP);//  with a pullup
 
 	
+	LTC1857init();  // build the CV scan command list
+	exp2_init();    // pitch lookup table
+	midimap_init();
+	loops_init();
+	stretch_init();
+	softclip_check();  // NEON and scalar clippers agree, before any output is rendered
+	grain_init();
+	fx_init();
+	conv_init();
+	quant_init();
+	cvcal_load();   // CV calibration
+	calselect();    // show channel 1 calibration in the setup menu
+
 // start up the OLED display
 
 	// SPI change parameters to fit to your LCD
@@ -673,6 +1342,7 @@ int main(void)
 	menutitle=maintitle;
 	drawtopmenu(0);
 	drawselector(topmenuindex);
+	oledupdate();
 	
 // start up the encoder event reader thread
 	char event[80]={"/dev/input/by-path/platform-rotary@d-event"};
@@ -696,6 +1366,13 @@ int main(void)
     }
 
 	
+    printf("main() : creating display thread,\n ") ;
+    rc = pthread_create(&display_thread, NULL, displaythread, NULL);
+    if (rc) {
+        printf("Error:unable to create display thread, %d\n", rc);
+        exit(-1);
+    }	
+
     printf("main() : creating menu thread,\n ") ;
     rc = pthread_create(&menu_thread, NULL, menu, NULL);
     if (rc) {
@@ -703,69 +1380,130 @@ int main(void)
         exit(-1);
     }	
 
-// load default audio samples
+    printf("main() : creating fast CV thread,\n ") ;
+    rc = pthread_create(&fastcv_thread, NULL, fastcvthread, NULL);
+    if (rc) {
+        printf("Error:unable to create fast CV thread, %d\n", rc);
+        exit(-1);
+    }	
+
+    printf("main() : creating sample index thread,\n ") ;
+    rc = pthread_create(&index_thread, NULL, indexthread, NULL);
+    if (rc) {
+        printf("Error:unable to create sample index thread, %d\n", rc);
+        exit(-1);
+    }	
+
+    printf("main() : creating effects thread,\n ") ;
+    rc = pthread_create(&fx_thread, NULL, fxthread, NULL);
+    if (rc) {
+        printf("Error:unable to create effects thread, %d\n", rc);
+        exit(-1);
+    }	
+
+    printf("main() : creating convolution thread,\n ") ;
+    rc = pthread_create(&conv_thread, NULL, convthread, NULL);
+    if (rc) {
+        printf("Error:unable to create convolution thread, %d\n", rc);
+        exit(-1);
+    }	
+
+    printf("main() : creating kit loader thread,\n ") ;
+    rc = pthread_create(&kit_thread, NULL, kitthread, NULL);
+    if (rc) {
+        printf("Error:unable to create kit loader thread, %d\n", rc);
+        exit(-1);
+    }	
+
+// load default audio samples - kit 1 if there is one, otherwise the defaults above
 	
-	printf("loading samples\n");
+	if (kit_read(1,samp,NULL)) {
+		printf("loading kit 1\n");
+		kitcurrent=1;
+	}
+	else printf("loading samples\n");
 	
 	for (i=0; i< NUMSAMPLES;++i) {  
-		char temp[80];
-		strcpy(temp,filesroot);
-		strcat(temp,"/");
-		strcat(temp,samp[i].filename);
+		char temp[PATHLEN];
+		snprintf(temp,PATHLEN,"%s/%s",filesroot,samp[i].filename);
 		audioFile[i].load(temp); // **** need error checking here for filename
+		slice_detect(audioFile[i],&sampleslices[i]);
 		// audioFile[i].printSummary();
 	}
+	loops_build();  // sustain loop crossfades - the kit loader does this from now on
 
-// start up Portaudio
+// start up the native ALSA backend if it was asked for, otherwise Portaudio
+
+	if (alsadevice != NULL) {
+		if (!alsa_open(alsadevice)) exit(EXIT_FAILURE);
+		printf("main() : creating ALSA audio thread,\n ") ;
+		rc = pthread_create(&alsa_thread, NULL, alsathread, NULL);
+		if (rc) {
+			printf("Error:unable to create ALSA audio thread, %d\n", rc);
+			exit(-1);
+		}
+		goto audiostarted;
+	}
 	
     err = Pa_Initialize();
     if( err != paNoError ) goto error;
 
     outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
+    if (devicename != NULL) outputParameters.device = pa_finddevice(devicename);
     if (outputParameters.device == paNoDevice) {
-      fprintf(stderr,"Error: No default output device.\n");
+      fprintf(stderr,"Error: No output device.\n");
+      goto error;
+    }
+    if (Pa_GetDeviceInfo( outputParameters.device )->maxOutputChannels < outchannels) {
+      fprintf(stderr,"Error: %s doesn't have %d output channels.\n",Pa_GetDeviceInfo( outputParameters.device )->name,outchannels);
       goto error;
     }
-    outputParameters.channelCount = 2;       /* stereo output */
-    outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
-    outputParameters.suggestedLatency = Pa_GetDeviceInfo( outputParameters.device )->defaultLowOutputLatency;
+    printf("Output %s, %d channels\n",Pa_GetDeviceInfo( outputParameters.device )->name,outchannels);
+    outputParameters.channelCount = outchannels;       /* a stereo pair for each output */
+    if (outformat == OUTAUTO) outformat=OUTFLOAT;  /* PortAudio converts if the device wants something else */
+    switch (outformat) {  /* the renderer writes this format so PortAudio doesn't have to convert it */
+      case OUTS16: outputParameters.sampleFormat = paInt16; break;
+      case OUTS24:
+      case OUTS32: outputParameters.sampleFormat = paInt32; break;
+      default: outputParameters.sampleFormat = paFloat32; break;
+    }
+    outbytes = (outformat == OUTS16) ? 2 : 4;
+    printf("Output format %s\n",textformats[outformat]);
     outputParameters.hostApiSpecificStreamInfo = NULL;
 
-    err = Pa_OpenStream(
-              &stream,
-              NULL, /* no input */
-              &outputParameters,
-              SAMPLE_RATE,
-              FRAMES_PER_BUFFER,
-              paClipOff,      /* we won't output out of range samples so don't bother clipping them */
-              patestCallback,
-              &data );
-    if( err != paNoError ) goto error;
-
-    //sprintf( data.message, "No Message" );
-    err = Pa_SetStreamFinishedCallback( stream, &StreamFinished );
+    err = pa_start( &stream, &outputParameters );  /* buffer size comes from the latency step */
     if( err != paNoError ) goto error;
 
-    err = Pa_StartStream( stream );
-    if( err != paNoError ) goto error;
+audiostarted:
 	
-	// set up serial MIDI
-	serial = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY ); 
-	if (serial < 0) 
-	{
-		printf("Can't open MIDI serial\n"); 
-		exit(-1); 
-	}
-	midi_init(serial);   // set up serial port for MIDI use
-	printf("main() : creating MIDI thread,\n ") ;
-    rc = pthread_create(&midi_thread, NULL, read_midi_from_serial_port, NULL);
+	// set up MIDI inputs - the UART by default
+	if (nummidinames == 0) midinames[nummidinames++]="/dev/ttyAMA0";
+	for (i=0; i< nummidinames;++i) midi_open(midinames[i]);  // missing inputs are not fatal
+	printf("main() : creating MIDI dispatch thread,\n ") ;
+    rc = pthread_create(&midi_thread, NULL, midi_dispatch_thread, NULL);
     if (rc) {
         printf("Error:unable to create MIDI thread, %d\n", rc);
         exit(-1);
     }	
 
+	applied=latencystep;
 	while(1) {
 		sleep(1.0);   // loop here forever while the threads and callback work
+		latency_tune();
+		if (latencystep != applied) {  // tuner or the menu changed the buffer
+			if (alsadevice == NULL) {  // the ALSA thread does its own
+				err = pa_restart( &stream, &outputParameters );
+				if( err != paNoError ) {  // the device won't take that one - hold it and go back to what we had
+					printf("PortAudio can't do latency step %d: %s\n",latencystep,Pa_GetErrorText(err));
+					latencyrefused=latencystep;
+					latencystep=applied;
+					err = pa_start( &stream, &outputParameters );
+					if( err != paNoError ) goto error;
+				}
+			}
+			applied=latencystep;
+			latency_save();
+		}
 		//for (i=0;i<8;++i) printf("%d ",(int16_t)(cv[0]*1000));
 		//printf("\n");
 	}
@@ -0,0 +1,183 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// automatic slicing - finds the transients in a sample so a drum loop can be played like a kit
+// each sample is analysed right after it is loaded, on the thread that loads it
+// the analysis is an energy onset detector: mean square level over short hops, a slice starts where the level jumps up
+// the energy pass is the slow part so long files are split up and run on a worker thread per core
+// a slot's Slice mode picks which slice a trigger plays:
+// Step - each trigger plays the next slice
+// Note - in percussion MIDI mode the trigger note plays slice 1, the note above slice 2 and so on
+// CV - the Slice CV channel picks the slice, 0V is the first one
+// a slice plays to its end and stops - backwards if the speed is negative
+// MIDI notes don't start slices themselves - they leave a request in slicereq[] for the renderer to apply at the
+// start of the next block, so the phasor and slice bounds are only ever written by the audio thread
+
+#define SLICE_MAX 64          // max slices per sample
+#define SLICE_HOP 256         // analysis hop in samples - about 6ms
+#define SLICE_RISE 4.0        // energy has to jump by this ratio (6dB) over the last few hops
+#define SLICE_FLOOR 1e-4      // and be within 40dB of the loudest hop
+#define SLICE_MINGAP 0.05     // min slice length in seconds
+#define SLICE_PARALLEL 441000 // files longer than this many samples are analysed on several cores
+#define SLICE_THREADS 4       // max worker threads
+#define SLICE_TRIG -1         // slice_trigger() note for a trigger input or a Step/CV slice
+
+struct slicelist {
+	int16_t count;                 // number of slices, 0 if the sample is empty
+	int32_t point[SLICE_MAX+1];    // first sample of each slice, point[count] is the end of the sample
+};
+
+slicelist sampleslices[NUMSAMPLES];  // slices of the samples that are playing
+
+struct sliceplayback {
+	bool on;         // playing a slice
+	int32_t lo,hi;   // slice being played - stops when it reaches the end it's heading for
+	int16_t step;    // next slice in Step mode
+} sliceplay[NUMSAMPLES];
+
+std::atomic<int16_t> slicereq[NUMSAMPLES];  // start request from the MIDI thread - 0=none, otherwise the slice_trigger() note+2
+
+// ask the renderer to start slot s on its next block - note is as for slice_trigger()
+void slice_request(int s, int note) {
+	slicereq[s]=note+2;
+}
+
+// worker for the energy pass - mean square level of hops first to last-1
+struct slicejob {
+	const AudioFile<double> *audio;
+	int32_t first,last;
+	float *energy;
+};
+
+void *slice_energy(void *arg) {
+	slicejob *j=(slicejob *)arg;
+	int channels=j->audio->getNumChannels();
+	for (int32_t h=j->first;h<j->last;++h) {
+		double sum=0;
+		for (int ch=0;ch<channels;++ch) {
+			const double *p=&j->audio->samples[ch][h*SLICE_HOP];
+			for (int i=0;i<SLICE_HOP;++i) sum+=p[i]*p[i];
+		}
+		j->energy[h]=(float)(sum/(SLICE_HOP*channels));
+	}
+	return 0;
+}
+
+// find the slices in a sample - called by whatever loaded it, never the audio thread
+void slice_detect(const AudioFile<double> &audio, slicelist *out) {
+	int32_t frames=audio.getNumSamplesPerChannel();
+	int32_t hops=frames/SLICE_HOP;
+	int32_t h;
+
+	out->count=0;
+	if (frames <= 0) return;
+	out->point[out->count++]=0;  // always a slice at the start
+	if (hops >= 4) {
+		std::vector<float> energy(hops);
+		int nthreads=1;
+		if (frames > SLICE_PARALLEL) {
+			nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+			if (nthreads > SLICE_THREADS) nthreads=SLICE_THREADS;
+			if (nthreads < 1) nthreads=1;
+		}
+		slicejob jobs[SLICE_THREADS];
+		pthread_t workers[SLICE_THREADS];
+		for (int t=0;t<nthreads;++t) {
+			jobs[t].audio=&audio;
+			jobs[t].first=(int64_t)hops*t/nthreads;
+			jobs[t].last=(int64_t)hops*(t+1)/nthreads;
+			jobs[t].energy=energy.data();
+		}
+		for (int t=1;t<nthreads;++t) {  // this thread does the first part itself
+			if (pthread_create(&workers[t],NULL,slice_energy,&jobs[t])) {
+				slice_energy(&jobs[t]);  // no thread - just do it here
+				jobs[t].audio=NULL;
+			}
+		}
+		slice_energy(&jobs[0]);
+		for (int t=1;t<nthreads;++t) if (jobs[t].audio != NULL) pthread_join(workers[t],NULL);
+
+		float loudest=*std::max_element(energy.begin(),energy.end());
+		int32_t mingap=(int32_t)(SLICE_MINGAP*audio.getSampleRate()/SLICE_HOP);
+		int32_t last=0;
+		for (h=3;(h < hops) && (out->count < SLICE_MAX);++h) {
+			float before=(energy[h-1]+energy[h-2]+energy[h-3])/3;
+			if ((energy[h] < loudest*SLICE_FLOOR) || (energy[h] < before*SLICE_RISE) || (h-last < mingap)) continue;
+			out->point[out->count++]=(h-1)*SLICE_HOP;  // the jump starts somewhere in the hop before
+			last=h;
+		}
+	}
+	out->point[out->count]=frames;
+}
+
+// start a slot playing a slice - note is the slice number for Note mode, SLICE_TRIG for a trigger or Step/CV
+// sets the phasor and returns true if the slot is slicing, otherwise the caller starts it the normal way
+// a Note mode note with no slice returns false without touching the slice that is playing - the caller ignores it
+// audio thread only
+bool slice_trigger(int s, int note) {
+	slicelist *l=&sampleslices[s];
+	int n;
+
+	if (l->count == 0) {
+		sliceplay[s].on=0;
+		return 0;
+	}
+	switch (samp[s].slicemode) {
+		case SLICESTEP:
+			n=sliceplay[s].step % l->count;
+			sliceplay[s].step=n+1;
+			break;
+		case SLICENOTE:
+			if (note == SLICE_TRIG) {  // trigger input steps through them
+				n=sliceplay[s].step % l->count;
+				sliceplay[s].step=n+1;
+			}
+			else if (note < l->count) n=note;
+			else return 0;
+			break;
+		case SLICECV:
+			if (samp[s].sliceCV == 0) {
+				sliceplay[s].on=0;
+				return 0;
+			}
+			n=(int)(cv[samp[s].sliceCV-1]*l->count);
+			if (n >= l->count) n=l->count-1;
+			if (n < 0) n=0;
+			break;
+		default:
+			sliceplay[s].on=0;
+			return 0;
+	}
+	double frames=l->point[l->count];
+	sliceplay[s].lo=l->point[n];
+	sliceplay[s].hi=l->point[n+1];
+	if (samp[s].speed >= 0) samp[s].phasor=sliceplay[s].lo/frames;
+	else samp[s].phasor=(sliceplay[s].hi-1)/frames;
+	sliceplay[s].on=1;
+	return 1;
+}
@@ -0,0 +1,284 @@
+
+// Copyright 2022 Rich Heslip
+//
+// Author: Rich Heslip
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// See http://creativecommons.org/licenses/MIT/ for more information.
+//
+// -----------------------------------------------------------------------------
+//
+//
+// time stretch voices - playback speed and pitch are independent
+// normally speed, transpose, MIDI note and pitch CV all end up in one phase increment so pitching up shortens the sound
+// a slot with Stretch on is played with WSOLA instead: Hann windowed grains overlapped by half, each grain read
+// at the pitch ratio from where the playhead is, and the playhead moves at the speed
+// each grain start is nudged by up to STRETCH_SEEK samples to where it best lines up with the way the last grain
+// was heading, which is what keeps it from sounding phasey. the first grain of a note has nothing to overlap so
+// it starts at full level rather than fading in, which would soften every drum hit
+// the search and the grain are the expensive part, so the next grain is worked out a hop ahead and the work is
+// spread evenly over the hop - a few correlation lags or grain samples per output sample, so every block of a voice
+// costs about the same. the grain parameters are taken when the grain is started so speed and pitch changes take a hop
+// the render time of each voice is measured so the Status menu can show the worst block, and Max Stretch caps
+// how many run at once - a slot gets a stretch engine when its note starts and keeps it to the end of the note,
+// a note that starts when they are all busy plays the normal way
+
+#define STRETCH_GRAIN 2048       // grain length in samples - about 46ms
+#define STRETCH_HOP (STRETCH_GRAIN/2)
+#define STRETCH_SEEK 384         // search this far either side of the playhead for the best grain start
+#define STRETCH_SEEKSTEP 8       // coarse search step
+#define STRETCH_CORR 512         // samples compared when lining up a grain
+#define STRETCH_CORRSTEP 4       // use every 4th one
+#define STRETCH_LAGS (2*STRETCH_SEEK/STRETCH_SEEKSTEP+1)       // grain starts tried
+#define STRETCH_NCORR (STRETCH_CORR/STRETCH_CORRSTEP)           // reads per start tried
+#define STRETCH_WORK (STRETCH_LAGS*STRETCH_NCORR+2*STRETCH_GRAIN)  // interpolated reads to make a grain
+
+struct stretchvoice {
+	float grain[3][2][STRETCH_GRAIN];  // windowed grains - the last one, the one going out and the next one
+	int8_t cur;        // grain[cur] is going out, its first half added to the second half of the one before
+	int32_t outpos;    // samples of this hop that have gone out
+	double playhead;   // where the next grain should come from, in samples
+	double expect;     // phasor we left - anything else means the slot was retriggered
+	// the next grain - worked on a bit at a time through the hop
+	float ref[STRETCH_NCORR];  // audio where the grain going out is heading - what the next one lines up with
+	double step;       // read step - the pitch ratio, negative backwards
+	double lo,hi;      // part of the sample it can read
+	bool wrap;         // loops wrap round
+	bool empty;        // past the end - nothing to make
+	bool attack;       // first grain of a note - nothing before it to fade from so its first half is flat
+	double target;     // where the search is centred - the playhead when the grain was set up
+	double start;      // best start found so far, then where it starts
+	float best;        // its correlation
+	int32_t lag;       // next start to try
+	int32_t built;     // grain samples made
+	int32_t work;      // reads done so far
+	int16_t pasttheend;  // empty grains in a row - done when all the real ones are out
+	bool running;
+	bool denied;       // no engine free when the note started - it plays the normal way to the end of the note
+	float peakus;      // worst recent block render time in us
+} stretch[NUMSAMPLES];
+
+float pitchratio[NUMSAMPLES];  // pitch of stretch and granular voices - updatephaseinc() works it out once per block
+float stretchwindow[STRETCH_GRAIN];  // periodic Hann - two of them half a grain apart add up to 1
+int16_t stretchmax=4;     // max stretch voices at once
+float stretchblockus=1;   // length of the last block in us - for the load figure
+
+void stretch_init(void) {
+	for (int i=0;i<STRETCH_GRAIN;++i) stretchwindow[i]=0.5f-0.5f*cosf(2*M_PI*i/STRETCH_GRAIN);
+}
+
+// call at the start of each block before the slots are rendered
+void stretch_begin(unsigned long frames) {
+	stretchblockus=(float)frames*1000000/SAMPLE_RATE;
+}
+
+// can this slot run as a stretch voice this block?
+// a voice that is running keeps its engine, a new note gets one if fewer than stretchmax are running
+bool stretch_claim(int s) {
+	stretchvoice *v=&stretch[s];
+	if ((samp[s].voice != VOICESTRETCH) || (samp[s].state == SILENT)) {
+		v->running=0;
+		v->denied=0;
+		return 0;
+	}
+	if (v->running) return 1;
+	if (v->denied) return 0;
+	int n=0;
+	for (int t=0;t<NUMSAMPLES;++t) n+=stretch[t].running;
+	if (n >= stretchmax) {
+		v->denied=1;
+		return 0;
+	}
+	return 1;
+}
+
+// interpolated sample at a fractional position - loops wrap around, otherwise outside the sample is silence
+inline float stretch_read(const double *src, double pos, int32_t size, bool wrap) {
+	if (wrap) {
+		pos=fmod(pos,size);
+		if (pos < 0) pos+=size;
+	}
+	else if ((pos < 0) || (pos >= size)) return 0;
+	int32_t i=(int32_t)pos;
+	int32_t j=(i+1 < size) ? i+1 : (wrap ? 0 : i);
+	float f=pos-i;
+	return src[i]+(src[j]-src[i])*f;
+}
+
+// set up the next grain from the playhead and move the playhead on a hop - speed is in samples per output sample
+// heading is where the grain going out would carry on from, or -1 if there isn't one so there's nothing to line up with
+void stretch_next(int s, double speed, double heading) {
+	stretchvoice *v=&stretch[s];
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	double dir=(speed < 0) ? -1.0 : 1.0;
+
+	v->wrap=(samp[s].mode == LOOPED) && !sliceplay[s].on;
+	v->step=dir*pitchratio[s];  // grains play backwards too if the speed is negative
+	v->lo=0;
+	v->hi=size;
+	if (sliceplay[s].on) {  // a slice ends where the slice does
+		v->lo=sliceplay[s].lo;
+		v->hi=sliceplay[s].hi;
+	}
+	v->target=v->playhead;
+	v->start=v->playhead;
+	v->best=-1e30f;
+	v->built=0;
+	v->attack=(heading < 0);
+	v->empty=!v->wrap && ((v->playhead < v->lo) || (v->playhead >= v->hi));
+	if (v->empty) ++v->pasttheend;
+	else v->pasttheend=0;
+	if (v->empty || (heading < 0)) {  // no search
+		v->lag=STRETCH_LAGS;
+		v->work=STRETCH_LAGS*STRETCH_NCORR;
+	}
+	else {
+		const double *src=audioFile[s].samples[0].data();
+		for (int k=0;k<STRETCH_NCORR;++k) v->ref[k]=stretch_read(src,heading+k*STRETCH_CORRSTEP*v->step,size,v->wrap);
+		v->lag=0;
+		v->work=0;
+	}
+	v->playhead+=STRETCH_HOP*speed;
+	if (v->wrap) {
+		v->playhead=fmod(v->playhead,size);
+		if (v->playhead < 0) v->playhead+=size;
+	}
+}
+
+// carry on making the next grain until upto reads have been done - first the search, normalized cross correlation
+// of each start near the playhead with the audio the last grain was heading into, then the windowed grain itself
+void stretch_work(int s, int32_t upto) {
+	stretchvoice *v=&stretch[s];
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	int channels=audioFile[s].getNumChannels();
+	float (*g)[STRETCH_GRAIN]=v->grain[(v->cur+1)%3];
+
+	while ((v->work < upto) && (v->lag < STRETCH_LAGS)) {
+		const double *src=audioFile[s].samples[0].data();
+		double pos=v->target+(v->lag*STRETCH_SEEKSTEP-STRETCH_SEEK);
+		float dot=0,energy=1e-9f;
+		for (int k=0;k<STRETCH_NCORR;++k) {
+			float x=stretch_read(src,pos+k*STRETCH_CORRSTEP*v->step,size,v->wrap);
+			dot+=x*v->ref[k];
+			energy+=x*x;
+		}
+		float score=dot/sqrtf(energy);
+		if (score > v->best) {
+			v->best=score;
+			v->start=pos;
+		}
+		++v->lag;
+		v->work+=STRETCH_NCORR;
+	}
+	if (v->work >= upto) return;
+	int32_t n=std::min((upto-v->work+1)/2,STRETCH_GRAIN-v->built);
+	int32_t first=v->built;
+	for (int c=0;c<2;++c) {
+		if (v->empty) {
+			memset(g[c]+first,0,n*sizeof(float));
+			continue;
+		}
+		const double *src=audioFile[s].samples[c ? channels-1 : 0].data();  // same channels as the normal renderer
+		for (int32_t i=first;i<first+n;++i) {
+			double pos=v->start+i*v->step;
+			if (!v->wrap && ((pos < v->lo) || (pos >= v->hi))) g[c][i]=0;
+			else g[c][i]=((v->attack && (i < STRETCH_HOP)) ? 1.0f : stretchwindow[i])*stretch_read(src,pos,size,v->wrap);
+		}
+	}
+	v->built+=n;
+	v->work+=2*n;
+}
+
+// render a block of a stretch voice - the slot's phaseinc is the speed and the pitch ratio is in pitchratio[s]
+void stretch_render(int s, float *outL, float *outR, unsigned long frames) {
+	stretchvoice *v=&stretch[s];
+	int32_t size=audioFile[s].getNumSamplesPerChannel();
+	struct timespec t0,t1;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	if (size <= 0) {
+		memset(outL,0,frames*sizeof(float));
+		memset(outR,0,frames*sizeof(float));
+		return;
+	}
+	double speed=samp[s].phaseinc*size;
+	if (!v->running || (samp[s].phasor != v->expect)) {  // just started or retriggered - make the first grain now
+		memset(v->grain,0,sizeof(v->grain));
+		v->playhead=samp[s].phasor*size;
+		v->pasttheend=0;
+		v->running=1;
+		v->cur=2;  // first grain goes in grain[0]
+		stretch_next(s,speed,-1);
+		stretch_work(s,STRETCH_WORK);
+		v->cur=0;
+		stretch_next(s,speed,v->start+STRETCH_HOP*v->step);
+		v->outpos=0;
+	}
+	unsigned long i=0;
+	while (i < frames) {
+		int32_t n=std::min((int32_t)(frames-i),STRETCH_HOP-v->outpos);
+		const float (*cur)[STRETCH_GRAIN]=v->grain[v->cur];
+		const float (*last)[STRETCH_GRAIN]=v->grain[(v->cur+2)%3];
+		for (int32_t k=0;k<n;++k) {  // second half of the last grain and first half of this one
+			int32_t p=v->outpos+k;
+			outR[i+k]=last[0][STRETCH_HOP+p]+cur[0][p];
+			outL[i+k]=last[1][STRETCH_HOP+p]+cur[1][p];
+		}
+		i+=n;
+		v->outpos+=n;
+		stretch_work(s,(int32_t)((int64_t)STRETCH_WORK*v->outpos/STRETCH_HOP));  // as much of the next grain as this far through the hop
+		if (v->outpos >= STRETCH_HOP) {  // next grain is done and starts going out
+			v->cur=(v->cur+1)%3;
+			stretch_next(s,speed,v->start+STRETCH_HOP*v->step);
+			v->outpos=0;
+		}
+	}
+	if (v->pasttheend >= 3) {  // last, current and next grains are all empty - the last real one is out
+		samp[s].state=SILENT;
+		sliceplay[s].on=0;
+		v->running=0;
+	}
+	double phasor=v->playhead/size;  // so the rest of the code sees where we are
+	if (phasor < 0) phasor=0;
+	if (phasor > 1.0) phasor=1.0;
+	samp[s].phasor=phasor;
+	v->expect=phasor;
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	float us=(t1.tv_sec-t0.tv_sec)*1e6f+(t1.tv_nsec-t0.tv_nsec)/1000.0f;
+	if (us > v->peakus) v->peakus=us;  // peak hold that dies away over a few seconds
+	else v->peakus*=0.999f;
+}
+
+// render cost for the status display - voices running, worst recent block per voice in us and all of them as a
+// percent of the block time. the worst block is what causes underruns so that's what is shown, not the average
+void stretch_stats(int16_t *voices, int16_t *us, int16_t *load) {
+	float total=0,worst=0;
+	int n=0;
+	for (int s=0;s<NUMSAMPLES;++s) {
+		if (!stretch[s].running) continue;
+		total+=stretch[s].peakus;
+		worst=std::max(worst,stretch[s].peakus);
+		++n;
+	}
+	*voices=n;
+	*us=(int16_t)std::min(worst,9999.0f);  // menus show 4 digits
+	*load=(int16_t)std::min(total*100/stretchblockus,9999.0f);
+}